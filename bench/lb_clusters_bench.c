@@ -0,0 +1,521 @@
+/*
+
+  lb_clusters_bench.c - host benchmark for the LightBurn cluster stream decoders
+
+  Feeds recorded (or synthetic) LightBurn raster files through the file and "normal"
+  stream decoders installed by lb_clusters.c and reports throughput per decoder, timed
+  by the fastest of the repeated runs.
+
+  ASCII clusters are also fed through a reference decoder that expands them by copying
+  as lb_clusters.c did before elements were served from slices of the input line, the
+  time per emitted character of each decoder is reported relative to it. Its output is
+  the same as that of the file decoder, compare the checksums.
+
+  Usage: lb_clusters_bench [-n repeat] [-b] [-d] [-o output_prefix] [file ...]
+
+  When no file is given a synthetic raster job is generated, with -b it is sent
+  with base64 encoded S values (requires LB_CLUSTERS_BINARY).
+  -d enables laser mode and a minimal parser emulation so that cluster elements are sent
+  directly to the (stub) planner when LB_CLUSTERS_DIRECT is enabled, the spindle state and
+  M4 rate adjustment of each direct motion are checked against the parser state, the reference
+  decoder is not run. With -o the expanded output of each decoder is written to
+  <output_prefix>.<decoder> for comparison.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "grbl/hal.h"
+#include "grbl/gcode.h"
+#include "grbl/motion_control.h"
+
+extern void lb_clusters_init (void);
+
+static struct {
+    char *data;
+    size_t length;
+    size_t pos;
+} source;
+
+typedef struct {
+    uint64_t chars;
+    uint64_t lines;
+    uint64_t oks;
+    uint64_t errors;
+    uint64_t moves;
+    uint64_t mismatch;
+    uint64_t empty;
+    uint32_t checksum;
+    FILE *out;
+} result_t;
+
+static result_t result;
+static const char *dump = NULL;
+
+static int16_t source_read (void)
+{
+    return source.pos < source.length ? (int16_t)(uint8_t)source.data[source.pos++] : SERIAL_NO_DATA;
+}
+
+static void stream_write (const char *s)
+{
+}
+
+static void report_options (bool newopt)
+{
+}
+
+static status_code_t status_message (status_code_t status_code)
+{
+    result.oks++;
+    if(status_code != Status_OK)
+        result.errors++;
+
+    return status_code;
+}
+
+static bool append (char **buf, size_t *length, size_t *size, const char *s, size_t n)
+{
+    if(*length + n + 1 > *size) {
+        *size = (*size + n) * 2;
+        if((*buf = realloc(*buf, *size)) == NULL)
+            return false;
+    }
+    memcpy(*buf + *length, s, n);
+    *length += n;
+    (*buf)[*length] = '\0';
+
+    return true;
+}
+
+static bool load_file (const char *name, char **buf, size_t *length, size_t *size)
+{
+    char chunk[4096];
+    size_t n;
+    FILE *file;
+
+    if((file = fopen(name, "rb")) == NULL) {
+        perror(name);
+        return false;
+    }
+
+    while((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if(!append(buf, length, size, chunk, n))
+            break;
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+// Reference decoder, each S value of a cluster is copied and the G1 command rebuilt with strcpy/strcat for every element.
+
+#define COPY_CLUSTER_SIZE 256
+
+static struct {
+    char block[LINE_BUFFER_SIZE];
+    char *s;
+    uint_fast16_t length;
+    char eol;
+} copy_input;
+
+static struct {
+    char block[LINE_BUFFER_SIZE];
+    char sval[COPY_CLUSTER_SIZE][10];
+    char param[24];
+    char *cmd;
+    char *s;
+    uint_fast16_t count;
+    uint_fast16_t next;
+} copy_cluster;
+
+// Copies the S value starting at s3 and ending at s2, returns false if it does not fit.
+static bool copy_sval (char *s3, char *s2)
+{
+    if(copy_cluster.count == COPY_CLUSTER_SIZE || s2 - s3 >= sizeof(copy_cluster.sval[0]))
+        return false;
+
+    memcpy(copy_cluster.sval[copy_cluster.count], s3, s2 - s3);
+    copy_cluster.sval[copy_cluster.count++][s2 - s3] = '\0';
+
+    return true;
+}
+
+static void copy_fill_buffer (void)
+{
+    int16_t c;
+
+    if(copy_cluster.count == 0) {
+
+        char *s = copy_input.block;
+
+        copy_input.s = s;
+        copy_input.length = 0;
+
+        while(copy_input.length < sizeof(copy_input.block) - 1 && (c = source_read()) != SERIAL_NO_DATA) {
+            *s++ = (char)c;
+            copy_input.length++;
+            if((char)c == '\n' || (char)c == '\r') {
+                copy_input.eol = (char)c;
+                break;
+            }
+        }
+
+        *s = '\0';
+
+        if(copy_input.length > 5 && !strncasecmp(copy_input.block, "G1", 2) && strchr(copy_input.block, ':')) {
+
+            char *s2 = copy_input.block, *s3;
+            uint_fast8_t params = 0;
+            float val;
+
+            s = copy_cluster.block;
+
+            while((c = *s2++)) {
+                if(c != ' ')
+                    *s++ = c;
+                if(c == 'S')
+                    break;
+            }
+            *s = '\0';
+
+            copy_cluster.cmd = copy_cluster.block;
+            copy_cluster.count = copy_cluster.next = 0;
+
+            for(s3 = s2; *s2; s2++) {
+                if(*s2 == ':') {
+                    *s2 = copy_input.eol;
+                    if(!copy_sval(s3, s2 + 1)) {
+                        copy_cluster.count = 0;
+                        return;
+                    }
+                    s3 = s2 + 1;
+                }
+            }
+            if(!copy_sval(s3, s2)) {
+                copy_cluster.count = 0;
+                return;
+            }
+
+            s = copy_cluster.cmd + 3;
+            read_float(s, &params, &val);
+            if(strchr(s, '\0') != s + params + 1 && strlen(s + params) < sizeof(copy_cluster.param)) {
+                strcpy(copy_cluster.param, s + params);
+                *strchr(copy_cluster.param, 'S') = copy_input.eol;
+                *strchr(copy_cluster.sval[0], copy_input.eol) = '\0';
+            } else
+                *copy_cluster.param = '\0';
+            strcpy(s, ftoa(val / (float)copy_cluster.count, 8));
+            copy_cluster.s = strchr(s, '\0');
+            while(*(copy_cluster.s - 1) == '0')
+                *(--copy_cluster.s) = '\0';
+            strcat(copy_cluster.s++, "S");
+        }
+    }
+
+    if(copy_cluster.count) {
+        strcpy(copy_cluster.s, copy_cluster.sval[copy_cluster.next++]);
+        if(*copy_cluster.param) {
+            strcat(copy_cluster.s, copy_cluster.param);
+            *copy_cluster.param = '\0';
+        }
+        if(copy_cluster.next == copy_cluster.count)
+            copy_cluster.count = 0;
+        copy_input.s = copy_cluster.cmd;
+        copy_input.length = strlen(copy_cluster.cmd);
+    }
+}
+
+static int16_t copy_decoder (void)
+{
+    int16_t c;
+
+    if(copy_input.length == 0)
+        copy_fill_buffer();
+
+    if(copy_input.length) {
+        c = *copy_input.s++;
+        copy_input.length--;
+    } else
+        c = SERIAL_NO_DATA;
+
+    return c;
+}
+
+static char *base64 (const uint8_t *data, uint_fast16_t length, char *s)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    uint32_t acc;
+
+    for(uint_fast16_t i = 0; i < length; i += 3) {
+        acc = data[i] << 16;
+        if(i + 1 < length)
+            acc |= data[i + 1] << 8;
+        if(i + 2 < length)
+            acc |= data[i + 2];
+        *s++ = digits[(acc >> 18) & 0x3F];
+        *s++ = digits[(acc >> 12) & 0x3F];
+        *s++ = i + 1 < length ? digits[(acc >> 6) & 0x3F] : '=';
+        *s++ = i + 2 < length ? digits[acc & 0x3F] : '=';
+    }
+
+    return s;
+}
+
+// Bidirectional raster scanlines with 16 pixel clusters at 0.1 mm pitch, similar to LightBurn output.
+// 8-bit S values are either sent as ASCII clusters or base64 encoded.
+static bool synthesize (char **buf, size_t *length, size_t *size, bool binary)
+{
+    char line[LINE_BUFFER_SIZE];
+    uint8_t pixels[16];
+    uint32_t seed = 1;
+    int n;
+
+    append(buf, length, size, "G90\nG21\nM4 S0\nG1 F18000\n", 24);
+
+    for(uint_fast16_t y = 0; y < 400; y++) {
+
+        n = snprintf(line, sizeof(line), "G0X0Y%.1f\nG91\n", y * 0.1f);
+        append(buf, length, size, line, n);
+
+        for(uint_fast16_t x = 0; x < 1008; x += 16) {
+
+            for(uint_fast8_t i = 0; i < 16; i++) {
+                seed = seed * 1103515245 + 12345;
+                pixels[i] = (uint8_t)(seed >> 16);
+            }
+
+            n = snprintf(line, sizeof(line), "G1X%s1.6S", y & 1 ? "-" : "");
+            if(binary) {
+                line[n++] = '@';
+                n = base64(pixels, 16, line + n) - line;
+            } else for(uint_fast8_t i = 0; i < 16; i++)
+                n += snprintf(line + n, sizeof(line) - n, "%s%u", i ? ":" : "", pixels[i]);
+            line[n++] = '\n';
+            append(buf, length, size, line, n);
+        }
+
+        append(buf, length, size, "G90\n", 4);
+    }
+
+    return append(buf, length, size, "M5\nM2\n", 6);
+}
+
+static uint32_t input_lines (void)
+{
+    uint32_t lines = 0;
+
+    for(size_t i = 0; i < source.length; i++) {
+        if(source.data[i] == '\n')
+            lines++;
+    }
+
+    return lines;
+}
+
+// Minimal parser emulation, tracks distance mode, motion mode, spindle state and X and Y positions
+// so that the decoders direct planner path can be exercised.
+static void parse (char *line)
+{
+    char c;
+    float value;
+    uint_fast8_t cc = 0, axis;
+
+    while((c = line[cc++])) {
+        switch(c) {
+
+            case 'G':
+                if(read_float(line, &cc, &value)) {
+                    if(value == 90.0f || value == 91.0f)
+                        gc_state.modal.distance_incremental = value == 91.0f;
+                    else if(value == 0.0f || value == 1.0f)
+                        gc_state.modal.motion = value == 1.0f ? MotionMode_Linear : MotionMode_Seek;
+                }
+                break;
+
+            case 'M':
+                if(read_float(line, &cc, &value) && value >= 3.0f && value <= 5.0f) {
+                    gc_state.modal.spindle.on = value != 5.0f;
+                    gc_state.modal.spindle.ccw = value == 4.0f;
+                    gc_state.is_rpm_rate_adjusted = value == 4.0f;
+                }
+                break;
+
+            case 'X':
+            case 'Y':
+                axis = c == 'X' ? 0 : 1;
+                if(read_float(line, &cc, &value))
+                    gc_state.position[axis] = gc_state.modal.distance_incremental ? gc_state.position[axis] + value : value;
+                break;
+        }
+    }
+}
+
+// Emulates the protocol loop: read a line, "execute" it and report status.
+static void run (void)
+{
+    char line[LINE_BUFFER_SIZE];
+    int16_t c;
+    uint_fast8_t idle = 0;
+    uint_fast16_t length = 0;
+
+    source.pos = 0;
+    mc_line_count = mc_line_mismatch = 0;
+    memset(&gc_state, 0, sizeof(parser_state_t));
+    memset(&result, 0, offsetof(result_t, out));
+    result.checksum = 2166136261u;
+
+    while(true) {
+
+        if((c = hal.stream.read()) == SERIAL_NO_DATA) {
+            result.empty++;
+            if(source.pos == source.length && ++idle > 4)
+                break;
+            continue;
+        }
+
+        idle = 0;
+        result.chars++;
+        result.checksum = (result.checksum ^ (uint8_t)c) * 16777619u;
+
+        if(result.out)
+            fputc(c, result.out);
+
+        if(c == '\n' || c == '\r') {
+            line[length] = '\0';
+            length = 0;
+            if(settings.mode == Mode_Laser)
+                parse(line);
+            result.lines++;
+            grbl.report.status_message(Status_OK);
+        } else if(length < sizeof(line) - 1)
+            line[length++] = (char)c;
+    }
+
+    result.moves = result.lines + mc_line_count;
+    result.mismatch = mc_line_mismatch;
+}
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Runs the input repeatedly through the decoder installed for the stream type, or through decoder if given.
+static bool bench (const char *name, stream_type_t type, stream_read_ptr decoder, uint32_t repeat, double *ns_char)
+{
+    double t, elapsed = 0.0;
+    uint32_t lines = input_lines();
+
+    if(dump) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s.%s", dump, name);
+        if((result.out = fopen(path, "wb")) == NULL)
+            perror(path);
+    }
+
+    hal.stream.type = type;
+    hal.stream.read = source_read;
+    grbl.on_stream_changed(type);
+    if(decoder)
+        hal.stream.read = decoder;
+
+    copy_input.length = copy_cluster.count = 0;
+
+    for(uint32_t i = 0; i < repeat; i++) {
+        t = now();
+        run();
+        t = now() - t;
+        if(i == 0 || t < elapsed)
+            elapsed = t;
+        if(result.out) {
+            fclose(result.out);
+            result.out = NULL;
+        }
+    }
+
+    *ns_char = elapsed * 1e9 / (double)result.chars;
+
+    printf("%-7s %12.0f chars/s %10.0f lines/s %10.0f sub-moves/s %8.2f ns/char  (%llu chars, %llu parsed, %llu direct (%llu mismatched), %llu ok (%llu errors), %llu empty reads, checksum %08x)\n",
+            name,
+            (double)result.chars / elapsed,
+            (double)lines / elapsed,
+            (double)result.moves / elapsed,
+            *ns_char,
+            (unsigned long long)result.chars,
+            (unsigned long long)result.lines,
+            (unsigned long long)(result.moves - result.lines),
+            (unsigned long long)result.mismatch,
+            (unsigned long long)result.oks,
+            (unsigned long long)result.errors,
+            (unsigned long long)result.empty,
+            result.checksum);
+
+    return result.mismatch == 0;
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t repeat = 20;
+    size_t size = 0;
+    bool binary = false;
+    int i;
+
+    for(i = 1; i < argc && *argv[i] == '-'; i++) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc)
+            repeat = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-d"))
+            settings.mode = Mode_Laser;
+        else if(!strcmp(argv[i], "-b"))
+            binary = true;
+        else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            dump = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [-n repeat] [-b] [-d] [-o output_prefix] [file ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(i == argc)
+        synthesize(&source.data, &source.length, &size, binary);
+    else for(; i < argc; i++) {
+        if(!load_file(argv[i], &source.data, &source.length, &size))
+            return 1;
+    }
+
+    if(source.data == NULL || repeat == 0)
+        return 1;
+
+    hal.stream.write = stream_write;
+    grbl.on_report_options = report_options;
+    grbl.report.status_message = status_message;
+
+    lb_clusters_init();
+
+    if(grbl.on_report_handlers_init)
+        grbl.on_report_handlers_init();
+
+    printf("Input: %zu bytes, %u lines, %u iterations\n", source.length, input_lines(), repeat);
+
+    double ns_copy, ns_file, ns_stream;
+    bool ok = bench("file", StreamType_File, NULL, repeat, &ns_file);
+    ok &= bench("stream", StreamType_Serial, NULL, repeat, &ns_stream);
+
+    if(!binary && settings.mode != Mode_Laser) {
+        bench("copy", StreamType_File, copy_decoder, repeat, &ns_copy);
+        printf("Time per char relative to copy: file %.2f, stream %.2f\n", ns_file / ns_copy, ns_stream / ns_copy);
+    }
+
+    free(source.data);
+
+    return ok ? 0 : 1;
+}
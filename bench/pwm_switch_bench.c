@@ -0,0 +1,188 @@
+/*
+
+  pwm_switch_bench.c - host micro-benchmark for the SLB laser S value to PWM mapping
+
+  Calls the update_rpm and get_pwm handlers registered by pwm_switch.c with a raster like
+  sequence of S values and reports the time and cycles per update. Each resulting PWM value
+  is checked against the linear spindle speed model of the core.
+
+  Usage: pwm_switch_bench [-n repeat] [-r rpm_max] [-m rpm_min] [-f pwm_freq] [-x]
+
+  -x uses S values with a fractional part, as output by S value scaling.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0ULL
+#endif
+
+#include "driver.h"
+
+#define N_VALUES 65536
+
+extern void pwm_switch_init (void);
+
+static float svalues[N_VALUES];
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void report_options (bool newopt)
+{
+}
+
+static bool set_float (setting_id_t id, float value)
+{
+    const setting_detail_t *setting = setting_get_details(id);
+
+    if(setting)
+        *(float *)setting->value = value;
+
+    return setting != NULL;
+}
+
+int main (int argc, char **argv)
+{
+    bool fractional = false;
+    uint32_t repeat = 200, seed = 1, mismatches = 0, max_error = 0, inexact = 0, max_inexact = 0;
+    float rpm_max = 255.0f, rpm_min = 0.0f, pwm_freq = 1000.0f;
+    volatile uint32_t sink = 0;
+    spindle_ptrs_t *laser;
+    spindle_pwm_t pwm_data;
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc)
+            repeat = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+            rpm_max = strtof(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-m") && i + 1 < argc)
+            rpm_min = strtof(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-f") && i + 1 < argc)
+            pwm_freq = strtof(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-x"))
+            fractional = true;
+        else {
+            fprintf(stderr, "Usage: %s [-n repeat] [-r rpm_max] [-m rpm_min] [-f pwm_freq] [-x]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(repeat == 0 || rpm_max <= rpm_min)
+        return 1;
+
+    grbl.on_report_options = report_options;
+
+    pwm_switch_init();
+
+    if((laser = spindle_get_hal(1, SpindleHAL_Configured)) == NULL)
+        return 1;
+
+    set_float(Setting_Laser_RpmMax, rpm_max);
+    set_float(Setting_Laser_RpmMin, rpm_min);
+    set_float(Setting_Laser_PWMFreq, pwm_freq);
+
+    if(!laser->config(laser) || !laser->cap.variable) {
+        fprintf(stderr, "Laser PWM configuration failed\n");
+        return 1;
+    }
+
+    // Reference PWM data for the linear model of the core, same clock as the laser timer (APB2).
+    memset(&pwm_data, 0, sizeof(spindle_pwm_t));
+    pwm_data.rpm_min = rpm_min;
+    pwm_data.period = (uint_fast16_t)((float)(HAL_RCC_GetPCLK2Freq() / (laser_pwm_timer.PSC + 1)) / pwm_freq);
+    pwm_data.min_value = 0;
+    pwm_data.max_value = pwm_data.period;
+    pwm_data.pwm_gradient = (float)(pwm_data.max_value - pwm_data.min_value) / (rpm_max - rpm_min);
+
+    // Raster like sequence, runs of similar power with random steps.
+    for(i = 0; i < N_VALUES; i++) {
+        seed = seed * 1103515245 + 12345;
+        if(i == 0 || (seed >> 28) == 0)
+            svalues[i] = 0.0f;
+        else {
+            svalues[i] = (float)((seed >> 8) % ((uint32_t)rpm_max + 1));
+            if(fractional)
+                svalues[i] += (float)((seed >> 4) & 0x0F) / 16.0f;
+            if(svalues[i] > rpm_max)
+                svalues[i] = rpm_max;
+        }
+    }
+
+    laser->set_state((spindle_state_t){ .on = On }, 0.0f);
+
+    // Compares the duty cycle output, the compare register is not updated when the output is disabled.
+    // The exact value is calculated in double precision from the same PWM range.
+    for(i = 0; i < N_VALUES; i++) {
+        uint32_t expected = spindle_compute_pwm_value(&pwm_data, svalues[i], false), actual, exact;
+        laser->update_rpm(svalues[i]);
+        actual = laser_pwm_timer.BDTR & TIM_BDTR_MOE ? LASER_PWM_TIMER_CCR : 0;
+        if(svalues[i] == 0.0f)
+            exact = 0;
+        else if(svalues[i] >= rpm_max)
+            exact = pwm_data.max_value;
+        else if(svalues[i] <= rpm_min)
+            exact = pwm_data.min_value;
+        else
+            exact = pwm_data.min_value + (uint32_t)floor(((double)svalues[i] - (double)rpm_min) * (double)(pwm_data.max_value - pwm_data.min_value) / ((double)rpm_max - (double)rpm_min));
+        if(actual != expected) {
+            mismatches++;
+            if(abs((int32_t)(actual - expected)) > max_error)
+                max_error = abs((int32_t)(actual - expected));
+        }
+        if(actual != exact) {
+            inexact++;
+            if(abs((int32_t)(actual - exact)) > max_inexact)
+                max_inexact = abs((int32_t)(actual - exact));
+        }
+    }
+
+    double t = now();
+    uint64_t c = cycles();
+
+    for(uint32_t r = 0; r < repeat; r++) {
+        for(i = 0; i < N_VALUES; i++)
+            laser->update_rpm(svalues[i]);
+    }
+
+    double t_update = now() - t;
+    uint64_t c_update = cycles() - c;
+
+    t = now();
+    c = cycles();
+
+    for(uint32_t r = 0; r < repeat; r++) {
+        for(i = 0; i < N_VALUES; i++)
+            sink += laser->get_pwm(svalues[i]);
+    }
+
+    double t_get = now() - t;
+    uint64_t c_get = cycles() - c;
+    double updates = (double)repeat * (double)N_VALUES;
+
+    printf("%s S to PWM, S %g-%g%s, PWM period %u, prescaler %u\n",
+            LASER_PWM_FIXED_POINT ? "Fixed point" : "Float",
+            rpm_min, rpm_max, fractional ? " fractional" : "",
+            (unsigned)laser_pwm_timer.ARR + 1, (unsigned)laser_pwm_timer.PSC + 1);
+    printf("update_rpm %8.2f ns/update %8.1f cycles/update\n", t_update * 1e9 / updates, (double)c_update / updates);
+    printf("get_pwm    %8.2f ns/update %8.1f cycles/update\n", t_get * 1e9 / updates, (double)c_get / updates);
+    printf("%u of %u PWM values differ from the float model of the core, max difference %u\n", mismatches, N_VALUES, max_error);
+    printf("%u of %u PWM values differ from the exact value, max difference %u\n", inexact, N_VALUES, max_inexact);
+
+    return 0;
+}
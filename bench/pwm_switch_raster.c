@@ -0,0 +1,303 @@
+/*
+
+  pwm_switch_raster.c - checks raster line output of pwm_switch.c from a simulated step interrupt
+
+  Raster lines are queued as the LightBurn clusters plugin does and their motions are executed as
+  stepper blocks with AMASS scaled step counts, the step pulse handler hooked by the plugin is called
+  for each step of the dominant axis. The step where each pixel is output is checked against its
+  position along the line, one step of deviation is allowed.
+
+  Also checked: pixel power is mapped by get_pwm of the spindle handlers passed when queuing, so that
+  power scaling hooked in by other plugins (coolant derating) applies, motions not tagged as a raster line
+  output the programmed power, lines whose motion
+  was not executed are discarded when a later line starts, the laser being off at the start of a line,
+  backlash motions tagged with the spindle handlers of a line not starting it, pixels spaced more than
+  32767 steps apart, flushing on reset and discarding stale lines when no motion is planned.
+
+  Usage: pwm_switch_raster
+
+  The exit code is non zero if a check fails.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "driver.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
+#include "pwm_switch.h"
+
+#ifndef MAX_AMASS_LEVEL
+#define MAX_AMASS_LEVEL 3
+#endif
+
+#ifndef LASER_RASTER_LINES
+#define LASER_RASTER_LINES 16
+#endif
+
+#define MAX_PIXELS 64
+#define MAX_STEPS 4000
+#define LONG_STEPS 70000 // Pixel spacing of more than 32767 steps.
+
+extern void pwm_switch_init (void);
+
+static spindle_ptrs_t *laser;
+static uint_fast16_t (*laser_get_pwm)(float rpm);
+static uint_fast16_t expected[MAX_PIXELS], output[LONG_STEPS + 1];
+static uint32_t failed = 0;
+static uint64_t time_us = 0;
+
+static void report_options (bool newopt)
+{
+}
+
+static void execute_realtime (sys_state_t state)
+{
+}
+
+static void reset (void)
+{
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return (uint32_t)(time_us / 1000);
+}
+
+static void driver_settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+}
+
+static void driver_pulse_start (stepper_t *stepper)
+{
+}
+
+static uint_fast16_t output_pwm (void)
+{
+    const sim_trace_t *trace = sim_get_trace();
+    sim_event_t *event = &trace->event[trace->n_events - 1];
+
+    return event->moe ? event->ccr : 0;
+}
+
+// Alternating low and high S values so that adjacent pixels differ.
+static float pixel_rpm (uint_fast16_t idx)
+{
+    return idx & 1 ? 250.0f - (float)idx : 5.0f + (float)idx;
+}
+
+// Half power, as the coolant plugin hooks get_pwm when derating.
+static uint_fast16_t derated_get_pwm (float rpm)
+{
+    return laser_get_pwm(rpm * 0.5f);
+}
+
+static bool check (bool ok, const char *test, const char *msg)
+{
+    if(!ok) {
+        failed++;
+        fprintf(stderr, "%s: %s\n", test, msg);
+    }
+
+    return ok;
+}
+
+static spindle_ptrs_t *enqueue (uint_fast16_t n_pixels)
+{
+    for(uint_fast16_t idx = 0; idx < n_pixels; idx++)
+        expected[idx] = laser->get_pwm(pixel_rpm(idx));
+
+    return laser_raster_enqueue(laser, n_pixels, pixel_rpm);
+}
+
+// Executes a motion along X of n_steps actual steps planned with the spindle handlers,
+// the output after each step is recorded.
+static void execute_block (spindle_ptrs_t *spindle, uint32_t n_steps, bool backlash_motion)
+{
+    segment_t segment = { .cycles_per_tick = 100 };
+    st_block_t block = {
+        .steps_per_mm = 80.0f,
+        .millimeters = (float)n_steps / 80.0f,
+        .programmed_rate = 6000.0f,
+        .step_event_count = n_steps << MAX_AMASS_LEVEL,
+        .steps[X_AXIS] = n_steps << MAX_AMASS_LEVEL,
+        .spindle = spindle,
+        .backlash_motion = backlash_motion
+    };
+    stepper_t stepper = {
+        .new_block = true,
+        .exec_block = &block,
+        .exec_segment = &segment,
+        .step_outbits.x = On
+    };
+
+    for(uint32_t step = 1; step <= n_steps; step++) {
+        sim_set_time(++time_us);
+        hal.stepper.pulse_start(&stepper);
+        stepper.new_block = false;
+        sim_flush();
+        output[step] = output_pwm();
+    }
+}
+
+static void execute (spindle_ptrs_t *spindle, uint32_t n_steps)
+{
+    execute_block(spindle, n_steps, false);
+}
+
+// Checks that each pixel is output in order, starting at the step closest to its position.
+static void check_pixels (const char *test, uint_fast16_t n_pixels, uint32_t n_steps)
+{
+    char msg[80];
+    uint32_t step = 1;
+
+    for(uint_fast16_t idx = 0; idx < n_pixels; idx++) {
+
+        while(step <= n_steps && output[step] != expected[idx])
+            step++;
+
+        float position = (float)idx * (float)n_steps / (float)n_pixels;
+
+        if(step > n_steps || fabsf((float)step - fmaxf(position, 1.0f)) > 1.0f) {
+            snprintf(msg, sizeof(msg), "pixel %u output at step %u, expected at %.1f", (unsigned)idx, step, position);
+            check(false, test, msg);
+            return;
+        }
+    }
+}
+
+static void check_constant (const char *test, uint_fast16_t pwm_value, uint32_t n_steps)
+{
+    char msg[80];
+
+    for(uint32_t step = 1; step <= n_steps; step++) {
+        if(output[step] != pwm_value) {
+            snprintf(msg, sizeof(msg), "output %u at step %u, expected %u", (unsigned)output[step], step, (unsigned)pwm_value);
+            check(false, test, msg);
+            return;
+        }
+    }
+}
+
+static void laser_state (bool on)
+{
+    laser->set_state((spindle_state_t){ .on = on }, 0.0f);
+    sim_flush();
+}
+
+int main (int argc, char **argv)
+{
+    spindle_ptrs_t *line, *next;
+    settings_changed_flags_t changed = {0};
+    uint_fast16_t n;
+
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.settings_changed = driver_settings_changed;
+    hal.stepper.pulse_start = driver_pulse_start;
+    grbl.on_report_options = report_options;
+    grbl.on_execute_realtime = execute_realtime;
+    grbl.on_reset = reset;
+
+    pwm_switch_init();
+
+    if((laser = spindle_get_hal(1, SpindleHAL_Configured)) == NULL || !laser->config(laser) || !laser->cap.variable) {
+        fprintf(stderr, "Laser PWM configuration failed\n");
+        return 1;
+    }
+
+    hal.settings_changed(&settings, changed);
+    grbl.on_spindle_selected(laser);
+
+    sim_reset();
+    laser_state(true);
+
+    // Integer and fractional pixel pitch.
+    if(check((line = enqueue(50)) != NULL, "pitch 20", "line not queued")) {
+        execute(line, 1000);
+        check_pixels("pitch 20", 50, 1000);
+    }
+
+    if(check((line = enqueue(37)) != NULL, "pitch 27.05", "line not queued")) {
+        execute(line, 1001);
+        check_pixels("pitch 27.05", 37, 1001);
+    }
+
+    // Power scaling hooked into get_pwm applies to pixels.
+    laser_get_pwm = laser->get_pwm;
+    laser->get_pwm = derated_get_pwm;
+    if(check((line = enqueue(30)) != NULL, "derated", "line not queued")) {
+        execute(line, 600);
+        check_pixels("derated", 30, 600);
+    }
+    laser->get_pwm = laser_get_pwm;
+
+    // A motion not tagged as a raster line outputs the programmed power, the queued line is kept for its own motion.
+    if(check((line = enqueue(40)) != NULL, "untagged", "line not queued")) {
+        laser->update_pwm(laser->get_pwm(100.0f));
+        execute(laser, 500);
+        check_constant("untagged", laser->get_pwm(100.0f), 500);
+        execute(line, 2000);
+        check_pixels("untagged", 40, 2000);
+    }
+
+    // The motion of the first line is not executed, it is discarded when the second starts.
+    if(check((line = enqueue(20)) != NULL && (next = enqueue(30)) != NULL, "missed line", "lines not queued")) {
+        execute(next, 900);
+        check_pixels("missed line", 30, 900);
+    }
+
+    // A line started with the laser off is discarded.
+    if(check((line = enqueue(20)) != NULL, "laser off", "line not queued")) {
+        laser_state(false);
+        execute(line, 400);
+        check_constant("laser off", 0, 400);
+        laser_state(true);
+        if(check((line = enqueue(25)) != NULL, "laser off", "next line not queued")) {
+            execute(line, 700);
+            check_pixels("laser off", 25, 700);
+        }
+    }
+
+    // A backlash motion is planned with the spindle handlers of the line motion that follows it, the line starts with the latter.
+    if(check((line = enqueue(20)) != NULL, "backlash", "line not queued")) {
+        laser->update_pwm(laser->get_pwm(100.0f));
+        execute_block(line, 50, true);
+        check_constant("backlash", laser->get_pwm(100.0f), 50);
+        execute(line, 800);
+        check_pixels("backlash", 20, 800);
+    }
+
+    // Pixels spaced more than 32767 steps apart.
+    if(check((line = enqueue(2)) != NULL, "long line", "line not queued")) {
+        execute(line, LONG_STEPS);
+        check_pixels("long line", 2, LONG_STEPS);
+    }
+
+    // Queued lines are flushed on reset.
+    for(n = 0; n < LASER_RASTER_LINES - 1 && enqueue(MAX_PIXELS); n++);
+    check(enqueue(MAX_PIXELS) == NULL, "reset", "buffer not full");
+    grbl.on_reset();
+    if(check((line = enqueue(MAX_PIXELS)) != NULL, "reset", "line not queued after reset")) {
+        execute(line, MAX_STEPS);
+        check_pixels("reset", MAX_PIXELS, MAX_STEPS);
+    }
+
+    // Lines left queued when idle with no motion planned are stale and discarded.
+    for(n = 0; n < LASER_RASTER_LINES - 1 && enqueue(MAX_PIXELS); n++);
+    plan_stub_empty = false;
+    state_stub = STATE_IDLE;
+    check(enqueue(MAX_PIXELS) == NULL, "stale", "lines discarded with motions planned");
+    plan_stub_empty = true;
+    if(check((line = enqueue(MAX_PIXELS)) != NULL, "stale", "stale lines not discarded")) {
+        state_stub = STATE_CYCLE;
+        execute(line, 3000);
+        check_pixels("stale", MAX_PIXELS, 3000);
+    }
+
+    printf("%u checks failed\n", failed);
+
+    return failed ? 2 : 0;
+}
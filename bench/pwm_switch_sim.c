@@ -0,0 +1,385 @@
+/*
+
+  pwm_switch_sim.c - replays laser jobs through pwm_switch.c with a simulated laser PWM timer
+
+  Interprets the laser related subset of a gcode file (G0, G1, G90, G91, M3, M4, M5, F, S and
+  axis words) as the core does in laser mode and calls the spindle handlers registered by the
+  plugin. Motions advance the simulation time by their length at the programmed feed rate,
+  acceleration is not simulated.
+
+  Each change of the PWM compare value, main output enable and laser enable pin is recorded with
+  the simulation time. The output is checked after every motion: off for rapids and when the laser
+  is off, the PWM value returned by get_pwm for the programmed S value otherwise.
+
+  Usage: pwm_switch_sim [-r rpm_max] [-m rpm_min] [-f pwm_freq] [-c power_curve] [-g enable_off_delay] [-o trace.csv] [-e expected.csv] file
+
+  -g sets the laser enable off delay in milliseconds, the realtime handler is called after each motion
+  with the millisecond tick count derived from the simulation time. -o writes the trace as CSV, -e compares the trace to a previously written one.
+  The exit code is non zero if a check fails or the trace differs from the expected trace.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "driver.h"
+#include "grbl/state_machine.h"
+
+#ifndef LASER_POWER_CURVE_SETTING
+#define LASER_POWER_CURVE_SETTING Setting_UserDefined_7
+#endif
+
+#ifndef LASER_ENABLE_OFF_DELAY_SETTING
+#define LASER_ENABLE_OFF_DELAY_SETTING Setting_UserDefined_6
+#endif
+
+extern void pwm_switch_init (void);
+
+static struct {
+    bool absolute;
+    bool rapid;
+    bool laser_on;
+    float feed_rate;
+    float rpm;
+    float position[N_AXIS];
+    uint64_t time_us;
+} machine = { .absolute = true, .rapid = true };
+
+static struct {
+    uint32_t lines;
+    uint32_t motions;
+    uint32_t calls;
+    uint32_t failed;
+    double elapsed;
+} stats = {0};
+
+static spindle_ptrs_t *laser;
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void report_options (bool newopt)
+{
+}
+
+static void execute_realtime (sys_state_t state)
+{
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return (uint32_t)(machine.time_us / 1000);
+}
+
+static bool set_setting (setting_id_t id, const char *value)
+{
+    const setting_detail_t *setting = setting_get_details(id);
+
+    if(setting == NULL)
+        return false;
+
+    if(setting->datatype == Format_String)
+        strcpy((char *)setting->value, value);
+    else if(setting->datatype == Format_Int16)
+        *(uint16_t *)setting->value = (uint16_t)strtoul(value, NULL, 10);
+    else
+        *(float *)setting->value = strtof(value, NULL);
+
+    return true;
+}
+
+static void set_state (bool on, bool ccw)
+{
+    double t = now();
+
+    laser->set_state((spindle_state_t){ .on = on, .ccw = ccw }, 0.0f);
+
+    stats.elapsed += now() - t;
+    stats.calls++;
+    sim_flush();
+}
+
+static void update_pwm (uint_fast16_t pwm_value)
+{
+    double t = now();
+
+    laser->update_pwm(pwm_value);
+
+    stats.elapsed += now() - t;
+    stats.calls++;
+    sim_flush();
+}
+
+static uint32_t output_pwm (void)
+{
+    const sim_trace_t *trace = sim_get_trace();
+    sim_event_t *event = &trace->event[trace->n_events - 1];
+
+    return event->moe ? event->ccr : 0;
+}
+
+static void check (uint32_t line, uint32_t expected)
+{
+    uint32_t actual = output_pwm();
+
+    if(actual != expected) {
+        if(stats.failed++ < 10)
+            fprintf(stderr, "Line %u: PWM output %u, expected %u\n", line, actual, expected);
+    }
+}
+
+static void motion (uint32_t line, const float *target)
+{
+    float distance = 0.0f;
+    uint_fast16_t off_value = laser->get_pwm(0.0f), pwm_value;
+
+    pwm_value = machine.laser_on && !machine.rapid ? laser->get_pwm(machine.rpm) : off_value;
+
+    update_pwm(pwm_value);
+    check(line, pwm_value == off_value ? 0 : pwm_value);
+
+    for(uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+        distance += (target[idx] - machine.position[idx]) * (target[idx] - machine.position[idx]);
+
+    if(!machine.rapid && machine.feed_rate > 0.0f)
+        machine.time_us += (uint64_t)(sqrtf(distance) * 60.0e6f / machine.feed_rate);
+
+    sim_set_time(machine.time_us);
+    memcpy(machine.position, target, sizeof(machine.position));
+    stats.motions++;
+
+    grbl.on_execute_realtime(STATE_CYCLE);
+    sim_flush();
+}
+
+static void execute (uint32_t line_number, char *line)
+{
+    char c;
+    float value, target[N_AXIS];
+    uint_fast8_t cc = 0, idx;
+    bool move = false, comment = false;
+
+    memcpy(target, machine.position, sizeof(target));
+
+    while((c = line[cc++])) {
+
+        if(comment || c == ';') {
+            comment = c != ')' && c != ';';
+            if(c == ';')
+                break;
+            continue;
+        }
+
+        if(c == '(') {
+            comment = true;
+            continue;
+        }
+
+        if(c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+
+        if(c < 'A' || c > 'Z' || !read_float(line, &cc, &value))
+            continue;
+
+        switch(c) {
+
+            case 'G':
+                if(value == 0.0f || value == 1.0f)
+                    machine.rapid = value == 0.0f;
+                else if(value == 90.0f || value == 91.0f)
+                    machine.absolute = value == 90.0f;
+                break;
+
+            case 'M':
+                if(value == 3.0f || value == 4.0f) {
+                    machine.laser_on = true;
+                    set_state(true, value == 4.0f);
+                } else if(value == 5.0f || value == 2.0f || value == 30.0f) {
+                    machine.laser_on = false;
+                    set_state(false, false);
+                    check(line_number, 0);
+                }
+                break;
+
+            case 'F':
+                machine.feed_rate = value;
+                break;
+
+            case 'S':
+                machine.rpm = value;
+                break;
+
+            case 'X':
+            case 'Y':
+            case 'Z':
+                idx = c - 'X';
+                target[idx] = machine.absolute ? value : target[idx] + value;
+                move = true;
+                break;
+        }
+    }
+
+    if(move)
+        motion(line_number, target);
+}
+
+static bool write_trace (const char *name)
+{
+    FILE *file;
+    const sim_trace_t *trace = sim_get_trace();
+
+    if((file = fopen(name, "w")) == NULL) {
+        perror(name);
+        return false;
+    }
+
+    fprintf(file, "time_us,ccr,moe,enable\n");
+
+    for(uint32_t i = 0; i < trace->n_events; i++)
+        fprintf(file, "%llu,%u,%u,%u\n", (unsigned long long)trace->event[i].time_us, trace->event[i].ccr, trace->event[i].moe, trace->event[i].enable);
+
+    fclose(file);
+
+    return true;
+}
+
+// Returns the number of events differing from the expected trace, reports the first.
+static uint32_t compare_trace (const char *name)
+{
+    FILE *file;
+    char line[80];
+    unsigned long long time_us;
+    unsigned ccr, moe, enable;
+    uint32_t i = 0, differences = 0;
+    const sim_trace_t *trace = sim_get_trace();
+
+    if((file = fopen(name, "r")) == NULL) {
+        perror(name);
+        return 1;
+    }
+
+    while(fgets(line, sizeof(line), file)) {
+
+        if(sscanf(line, "%llu,%u,%u,%u", &time_us, &ccr, &moe, &enable) != 4)
+            continue;
+
+        if(i >= trace->n_events || trace->event[i].time_us != time_us || trace->event[i].ccr != ccr ||
+            trace->event[i].moe != moe || trace->event[i].enable != enable) {
+            if(differences++ == 0)
+                fprintf(stderr, "Trace differs from %s at event %u: expected %llu,%u,%u,%u\n", name, i, time_us, ccr, moe, enable);
+        }
+        i++;
+    }
+
+    fclose(file);
+
+    if(i != trace->n_events) {
+        if(differences == 0)
+            fprintf(stderr, "Trace has %u events, %s has %u\n", trace->n_events, name, i);
+        differences += i > trace->n_events ? 0 : trace->n_events - i;
+    }
+
+    return differences;
+}
+
+int main (int argc, char **argv)
+{
+    char line[LINE_BUFFER_SIZE];
+    const char *trace_name = NULL, *expected_name = NULL, *rpm_max = "255", *rpm_min = "0", *pwm_freq = "1000", *curve = "", *delay = "0";
+    uint32_t differences = 0, enable_changes = 0;
+    FILE *file;
+    int i;
+
+    for(i = 1; i < argc && *argv[i] == '-' && i + 1 < argc; i++) {
+        if(!strcmp(argv[i], "-r"))
+            rpm_max = argv[++i];
+        else if(!strcmp(argv[i], "-m"))
+            rpm_min = argv[++i];
+        else if(!strcmp(argv[i], "-f"))
+            pwm_freq = argv[++i];
+        else if(!strcmp(argv[i], "-c"))
+            curve = argv[++i];
+        else if(!strcmp(argv[i], "-g"))
+            delay = argv[++i];
+        else if(!strcmp(argv[i], "-o"))
+            trace_name = argv[++i];
+        else if(!strcmp(argv[i], "-e"))
+            expected_name = argv[++i];
+        else
+            break;
+    }
+
+    if(i != argc - 1) {
+        fprintf(stderr, "Usage: %s [-r rpm_max] [-m rpm_min] [-f pwm_freq] [-c power_curve] [-g enable_off_delay] [-o trace.csv] [-e expected.csv] file\n", argv[0]);
+        return 1;
+    }
+
+    if((file = fopen(argv[i], "r")) == NULL) {
+        perror(argv[i]);
+        return 1;
+    }
+
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    grbl.on_report_options = report_options;
+    grbl.on_execute_realtime = execute_realtime;
+
+    pwm_switch_init();
+
+    if((laser = spindle_get_hal(1, SpindleHAL_Configured)) == NULL)
+        return 1;
+
+    set_setting(Setting_Laser_RpmMax, rpm_max);
+    set_setting(Setting_Laser_RpmMin, rpm_min);
+    set_setting(Setting_Laser_PWMFreq, pwm_freq);
+    set_setting(LASER_POWER_CURVE_SETTING, curve);
+    set_setting(LASER_ENABLE_OFF_DELAY_SETTING, delay);
+
+    if(!laser->config(laser) || !laser->cap.variable) {
+        fprintf(stderr, "Laser PWM configuration failed\n");
+        return 1;
+    }
+
+    if(grbl.on_spindle_selected)
+        grbl.on_spindle_selected(laser);
+
+    sim_reset();
+    set_state(false, false);
+
+    while(fgets(line, sizeof(line), file))
+        execute(++stats.lines, line);
+
+    fclose(file);
+
+    if(machine.laser_on)
+        set_state(false, false);
+
+    const sim_trace_t *trace = sim_get_trace();
+
+    for(i = 1; i < (int)trace->n_events; i++) {
+        if(trace->event[i].moe != trace->event[i - 1].moe || trace->event[i].enable != trace->event[i - 1].enable)
+            enable_changes++;
+    }
+
+    printf("%u lines, %u motions, %llu us job time\n", stats.lines, stats.motions, (unsigned long long)machine.time_us);
+    printf("%u handler calls, %.1f ns/call, %u timer register accesses, %u output changes\n",
+            stats.calls, stats.calls ? stats.elapsed * 1e9 / (double)stats.calls : 0.0, trace->accesses, trace->n_events);
+    printf("%u output or laser enable changes\n", enable_changes);
+    printf("%u checks failed\n", stats.failed);
+
+    if(trace_name && !write_trace(trace_name))
+        return 1;
+
+    if(expected_name && (differences = compare_trace(expected_name)))
+        printf("%u trace events differ from %s\n", differences, expected_name);
+
+    return stats.failed || differences ? 2 : 0;
+}
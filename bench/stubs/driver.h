@@ -0,0 +1,129 @@
+/*
+
+  driver.h - host stub for building the laser plugins on Linux
+
+  Only provides what the plugins and the benchmark harness needs, not a driver.
+
+*/
+
+#ifndef _BENCH_DRIVER_H_
+#define _BENCH_DRIVER_H_
+
+#ifndef LB_CLUSTERS_ENABLE
+#define LB_CLUSTERS_ENABLE 1
+#endif
+
+#include "grbl/hal.h"
+
+#if SIENCI_LASER_PWM
+
+// STM32 timer registers and HAL functions used by pwm_switch.c, implemented in stm32_stubs.c.
+
+typedef struct {
+    volatile uint32_t CR1;
+    volatile uint32_t CR2;
+    volatile uint32_t EGR;
+    volatile uint32_t CCMR1;
+    volatile uint32_t CCER;
+    volatile uint32_t PSC;
+    volatile uint32_t ARR;
+    volatile uint32_t CCR1;
+    volatile uint32_t BDTR;
+} TIM_TypeDef;
+
+typedef struct {
+    uint32_t Prescaler;
+    uint32_t CounterMode;
+    uint32_t Period;
+    uint32_t ClockDivision;
+    uint32_t RepetitionCounter;
+} TIM_Base_InitTypeDef;
+
+typedef struct {
+    uint32_t APB1CLKDivider;
+    uint32_t APB2CLKDivider;
+} RCC_ClkInitTypeDef;
+
+extern TIM_TypeDef laser_pwm_timer, ppi_timer;
+
+#if LASER_PWM_SIM
+
+// Simulated laser PWM timer, register accesses are routed via sim_laser_timer() which records
+// the compare value, main output enable (MOE) and laser enable pin on each change.
+
+typedef struct {
+    uint64_t time_us;
+    uint16_t ccr;
+    bool moe;
+    bool enable;
+} sim_event_t;
+
+typedef struct {
+    sim_event_t *event;
+    uint32_t n_events;
+    uint32_t accesses;
+} sim_trace_t;
+
+TIM_TypeDef *sim_laser_timer (void);
+void sim_flush (void);
+void sim_set_time (uint64_t time_us);
+void sim_reset (void);
+const sim_trace_t *sim_get_trace (void);
+
+#define LASER_PWM_TIMER         (sim_laser_timer())
+#define LASER_PWM_TIMER_CCR     (sim_laser_timer()->CCR1)
+#define LASER_PWM_TIMER_CCMR    (sim_laser_timer()->CCMR1)
+
+#else
+
+#define LASER_PWM_TIMER         (&laser_pwm_timer)
+#define LASER_PWM_TIMER_CCR     laser_pwm_timer.CCR1
+#define LASER_PWM_TIMER_CCMR    laser_pwm_timer.CCMR1
+
+#endif
+
+#define TIM_CR1_CEN             (1 << 0)
+#define TIM_CR2_OIS1            (1 << 8)
+#define TIM_EGR_UG              (1 << 0)
+#define TIM_CCMR1_OC1M          (7 << 4)
+#define TIM_CCMR1_OC1M_1        (2 << 4)
+#define TIM_CCMR1_OC1M_2        (4 << 4)
+#define TIM_CCER_CC1E           (1 << 0)
+#define TIM_CCER_CC1P           (1 << 1)
+#define TIM_BDTR_MOE            (1 << 15)
+#define TIM_BDTR_OSSR           (1 << 11)
+#define TIM_BDTR_OSSI           (1 << 10)
+#define TIM_COUNTERMODE_UP      0
+#define TIM_CLOCKDIVISION_DIV1  0
+#define RCC_HCLK_DIV1           0
+#define RCC_HCLK_DIV2           4
+
+#define __disable_irq()
+#define __enable_irq()
+
+#define TIMER_CLOCK_MUL(d) (d == RCC_HCLK_DIV1 ? 1 : 2)
+
+#define LASER_PWM_TIMER_N       1
+#define LASER_PWM_CCER_EN       TIM_CCER_CC1E
+#define LASER_PWM_CCER_POL      TIM_CCER_CC1P
+#define LASER_PWM_CCMR_OCM_SET  (TIM_CCMR1_OC1M_1|TIM_CCMR1_OC1M_2)
+#define LASER_PWM_CCMR_OCM_CLR  TIM_CCMR1_OC1M
+#define LASER_PWM_CR2_OIS       TIM_CR2_OIS1
+#define PPI_TIMER               (&ppi_timer)
+
+#define LASER_ENABLE_PORT       0
+#define LASER_ENABLE_PIN        1
+
+#define DIGITAL_OUT(port, pin, on) laser_enable_out(on)
+#define DIGITAL_IN(port, pin) laser_enable_in()
+
+void laser_enable_out (bool on);
+bool laser_enable_in (void);
+void HAL_RCC_GetClockConfig (RCC_ClkInitTypeDef *clock, uint32_t *latency);
+uint32_t HAL_RCC_GetPCLK1Freq (void);
+uint32_t HAL_RCC_GetPCLK2Freq (void);
+void TIM_Base_SetConfig (TIM_TypeDef *timer, TIM_Base_InitTypeDef *init);
+
+#endif
+
+#endif
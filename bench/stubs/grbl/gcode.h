@@ -0,0 +1,50 @@
+/*
+
+  gcode.h - host stub of the parser state referenced by the plugins
+
+*/
+
+#ifndef _BENCH_GCODE_H_
+#define _BENCH_GCODE_H_
+
+#include "hal.h"
+#include "planner.h"
+
+typedef enum {
+    MotionMode_Seek = 0,
+    MotionMode_Linear = 1
+} motion_mode_t;
+
+typedef enum {
+    FeedMode_UnitsPerMin = 0,
+    FeedMode_InverseTime = 1
+} feed_mode_t;
+
+typedef struct {
+    motion_mode_t motion;
+    feed_mode_t feed_mode;
+    bool distance_incremental;
+    spindle_state_t spindle;
+    coolant_state_t coolant;
+    gc_override_flags_t override_ctrl;
+} gc_modal_t;
+
+typedef struct {
+    float rpm;
+    spindle_ptrs_t *hal;
+} spindle_t;
+
+typedef struct {
+    gc_modal_t modal;
+    spindle_t spindle;
+    float feed_rate;
+    int32_t line_number;
+    bool is_rpm_rate_adjusted;
+    bool is_laser_ppi_mode;
+    float position[N_AXIS];
+    float tool_length_offset[N_AXIS];
+} parser_state_t;
+
+extern parser_state_t gc_state;
+
+#endif
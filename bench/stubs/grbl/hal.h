@@ -0,0 +1,366 @@
+/*
+
+  hal.h - host stub of the grblHAL core API used by the laser plugins
+
+  Declares the subset of the HAL, core handlers and utility functions referenced by
+  the plugins, with the same names and signatures as the grblHAL core.
+
+*/
+
+#ifndef _BENCH_HAL_H_
+#define _BENCH_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <strings.h>
+
+#ifndef LINE_BUFFER_SIZE
+#define LINE_BUFFER_SIZE 257
+#endif
+
+#define SERIAL_NO_DATA -1
+#define ASCII_CAN 0x18
+#define ASCII_EOL "\r\n"
+
+typedef enum {
+    Status_OK = 0,
+    Status_ExpectedCommandLetter = 1,
+    Status_BadNumberFormat = 2,
+    Status_InvalidStatement = 3,
+    Status_Overflow = 11,
+    Status_Unhandled
+} status_code_t;
+
+typedef enum {
+    StreamType_Serial = 0,
+    StreamType_MPG,
+    StreamType_Bluetooth,
+    StreamType_Telnet,
+    StreamType_WebSocket,
+    StreamType_SDCard,
+    StreamType_File = StreamType_SDCard,
+    StreamType_Redirected,
+    StreamType_Null
+} stream_type_t;
+
+typedef uint32_t nvs_address_t;
+
+typedef enum {
+    NVS_TransferResult_Failed = 0,
+    NVS_TransferResult_Busy,
+    NVS_TransferResult_OK
+} nvs_transfer_result_t;
+
+typedef struct {
+    nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+    nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum);
+} nvs_io_t;
+
+typedef enum {
+    Setting_UserDefined_0 = 450,
+    Setting_UserDefined_6 = 456,
+    Setting_UserDefined_7 = 457,
+    Setting_UserDefined_8 = 458,
+    Setting_UserDefined_9 = 459,
+    Setting_Laser_RpmMax = 730,
+    Setting_Laser_RpmMin,
+    Setting_Laser_PWMFreq,
+    Setting_Laser_PWMOffValue,
+    Setting_Laser_PWMMinValue,
+    Setting_Laser_PWMMaxValue,
+    Setting_Laser_XOffset,
+    Setting_Laser_YOffset,
+    Setting_LaserInvertMask
+} setting_id_t;
+
+typedef enum {
+    Group_General = 1,
+    Group_Spindle
+} setting_group_t;
+
+typedef enum {
+    Format_Bool = 0,
+    Format_Bitfield,
+    Format_XBitfield,
+    Format_RadioButtons,
+    Format_AxisMask,
+    Format_Integer,
+    Format_Decimal,
+    Format_String,
+    Format_Password,
+    Format_IPv4,
+    Format_Int8,
+    Format_Int16
+} setting_datatype_t;
+
+typedef enum {
+    Setting_NonCore = 0,
+    Setting_NonCoreFn,
+    Setting_IsExtended,
+    Setting_IsExtendedFn,
+    Setting_IsLegacy,
+    Setting_IsLegacyFn
+} setting_type_t;
+
+typedef struct {
+    uint8_t reboot_required :1,
+            allow_null      :1,
+            subgroups       :1,
+            increment       :4;
+} setting_detail_flags_t;
+
+typedef struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    bool (*is_available)(const struct setting_detail *setting);
+    setting_detail_flags_t flags;
+} setting_detail_t;
+
+typedef struct {
+    setting_id_t id;
+    const char *description;
+} setting_descr_t;
+
+typedef struct {
+    const setting_detail_t *settings;
+    uint8_t n_settings;
+    const setting_descr_t *descriptions;
+    uint8_t n_descriptions;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+} setting_details_t;
+
+#define On 1
+#define Off 0
+
+#ifndef N_AXIS
+#define N_AXIS 3
+#endif
+
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+
+typedef int16_t (*stream_read_ptr)(void);
+typedef void (*stream_write_ptr)(const char *s);
+
+typedef struct {
+    stream_type_t type;
+    stream_read_ptr read;
+    stream_write_ptr write;
+} io_stream_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t spindle :1,
+                 unassigned :31;
+    };
+} settings_changed_flags_t;
+
+typedef struct settings settings_t;
+typedef void (*settings_changed_ptr)(settings_t *settings, settings_changed_flags_t changed);
+
+typedef int8_t spindle_id_t;
+
+typedef enum {
+    SpindleType_PWM = 0,
+    SpindleType_Basic
+} spindle_type_t;
+
+typedef enum {
+    SpindleHAL_Raw = 0,
+    SpindleHAL_Configured,
+    SpindleHAL_Active
+} spindle_hal_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on  :1,
+                ccw :1,
+                unassigned :6;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint16_t value;
+    struct {
+        uint16_t variable         :1,
+                 direction        :1,
+                 at_speed         :1,
+                 laser            :1,
+                 pwm_invert       :1,
+                 rpm_range_locked :1,
+                 unassigned       :10;
+    };
+} spindle_cap_t;
+
+typedef struct {
+    float rpm_min;
+    bool invert_pwm;
+    bool always_on;
+    uint_fast16_t period;
+    uint_fast16_t off_value;
+    uint_fast16_t min_value;
+    uint_fast16_t max_value;
+    uint_fast16_t offset;
+    float pwm_gradient;
+} spindle_pwm_t;
+
+typedef struct spindle_ptrs spindle_ptrs_t;
+
+struct spindle_ptrs {
+    spindle_id_t id;
+    spindle_type_t type;
+    spindle_cap_t cap;
+    float rpm_min;
+    float rpm_max;
+    float pwm_off_value;
+    bool (*config)(spindle_ptrs_t *spindle);
+    void (*set_state)(spindle_state_t state, float rpm);
+    spindle_state_t (*get_state)(void);
+    uint_fast16_t (*get_pwm)(float rpm);
+    void (*update_pwm)(uint_fast16_t pwm);
+    void (*update_rpm)(float rpm);
+    void (*pulse_on)(uint_fast16_t pulse_length);
+};
+
+typedef struct {
+    float steps_per_mm;
+    float millimeters;
+    float programmed_rate;
+    bool dynamic_rpm;
+    uint32_t step_event_count;
+    uint32_t steps[N_AXIS];
+    spindle_ptrs_t *spindle;
+#ifdef ENABLE_BACKLASH_COMPENSATION
+    bool backlash_motion;
+#endif
+} st_block_t;
+
+typedef struct {
+    uint32_t cycles_per_tick;
+    uint_fast16_t spindle_pwm;
+} segment_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t x :1,
+                y :1,
+                z :1;
+    };
+} axes_signals_t;
+
+typedef struct {
+    bool new_block;
+    axes_signals_t step_outbits;
+    uint_fast8_t amass_level;
+    st_block_t *exec_block;
+    segment_t *exec_segment;
+} stepper_t;
+
+typedef struct {
+    void (*pulse_start)(stepper_t *stepper);
+    void (*go_idle)(bool clear_signals);
+} stepper_ptrs_t;
+
+typedef struct {
+    uint32_t f_step_timer;
+    uint32_t (*get_elapsed_ticks)(void);
+    io_stream_t stream;
+    nvs_io_t nvs;
+    stepper_ptrs_t stepper;
+    settings_changed_ptr settings_changed;
+} grbl_hal_t;
+
+typedef uint_fast16_t sys_state_t;
+
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_spindle_selected_ptr)(spindle_ptrs_t *spindle);
+typedef void (*on_stream_changed_ptr)(stream_type_t type);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_reset_ptr)(void);
+typedef void (*on_report_handlers_init_ptr)(void);
+typedef status_code_t (*status_message_ptr)(status_code_t status_code);
+
+typedef struct {
+    status_message_ptr status_message;
+} report_t;
+
+typedef struct {
+    report_t report;
+    on_stream_changed_ptr on_stream_changed;
+    on_report_options_ptr on_report_options;
+    on_reset_ptr on_reset;
+    on_report_handlers_init_ptr on_report_handlers_init;
+    on_spindle_selected_ptr on_spindle_selected;
+    on_execute_realtime_ptr on_execute_realtime;
+} grbl_t;
+
+typedef enum {
+    Mode_Standard = 0,
+    Mode_Laser,
+    Mode_Lathe
+} machine_mode_t;
+
+typedef struct {
+    float rpm_max;
+    float rpm_min;
+    struct {
+        uint8_t enable_rpm_controlled :1,
+                pwm_disable           :1,
+                unassigned            :6;
+    } flags;
+} spindle_settings_t;
+
+struct settings {
+    machine_mode_t mode;
+    spindle_settings_t spindle;
+};
+
+typedef struct {
+    volatile bool abort;
+    volatile bool cancel;
+} system_t;
+
+extern grbl_hal_t hal;
+extern grbl_t grbl;
+extern settings_t settings;
+extern system_t sys;
+
+#define ABORTED (sys.abort || sys.cancel)
+
+typedef enum {
+    Message_None = 0,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr);
+char *ftoa (float n, uint8_t decimal_places);
+char *uitoa (uint32_t n);
+void settings_register (setting_details_t *details);
+const setting_detail_t *setting_get_details (setting_id_t id);
+void report_message (const char *msg, message_type_t type);
+void protocol_enqueue_rt_command (void (*fn)(uint_fast16_t state));
+void system_flag_wco_change (void);
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle, const char *name);
+spindle_ptrs_t *spindle_get_hal (spindle_id_t spindle_id, spindle_hal_t hal);
+uint_fast16_t spindle_compute_pwm_value (spindle_pwm_t *pwm_data, float rpm, bool pid_limit);
+void spindle_update_caps (spindle_ptrs_t *spindle, spindle_pwm_t *pwm_caps);
+
+#endif
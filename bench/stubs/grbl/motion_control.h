@@ -0,0 +1,17 @@
+/*
+
+  motion_control.h - host stub, motions are counted rather than executed
+
+*/
+
+#ifndef _BENCH_MOTION_CONTROL_H_
+#define _BENCH_MOTION_CONTROL_H_
+
+#include "planner.h"
+
+extern uint32_t mc_line_count;
+extern uint32_t mc_line_mismatch; // motions with condition or override flags differing from the parser state
+
+bool mc_line (float *target, plan_line_data_t *pl_data);
+
+#endif
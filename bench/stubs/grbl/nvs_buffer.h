@@ -0,0 +1,9 @@
+/*
+
+  nvs_buffer.h - host stub, NVS allocation for plugin settings
+
+*/
+
+#include "hal.h"
+
+nvs_address_t nvs_alloc (size_t size);
@@ -0,0 +1,63 @@
+/*
+
+  planner.h - host stub of the planner interface referenced by the plugins
+
+*/
+
+#ifndef _BENCH_PLANNER_H_
+#define _BENCH_PLANNER_H_
+
+#include "hal.h"
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t flood :1,
+                mist  :1;
+    };
+} coolant_state_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t feed_rate_disable   :1,
+                feed_hold_disable   :1,
+                spindle_rpm_disable :1,
+                parking_disable     :1,
+                reserved            :3,
+                sync                :1;
+    };
+} gc_override_flags_t;
+
+typedef struct {
+    uint32_t value;
+    struct {
+        uint32_t is_rpm_rate_adjusted :1,
+                 is_laser_ppi_mode    :1,
+                 unassigned           :30;
+        spindle_state_t spindle;
+        coolant_state_t coolant;
+    };
+} planner_cond_t;
+
+typedef struct {
+    float rpm;
+    spindle_ptrs_t *hal;
+} plan_line_spindle_t;
+
+typedef struct {
+    float feed_rate;
+    plan_line_spindle_t spindle;
+    planner_cond_t condition;
+    gc_override_flags_t overrides;
+    int32_t line_number;
+} plan_line_data_t;
+
+typedef struct plan_block plan_block_t;
+
+extern bool plan_stub_empty; // Stub planner state, false when plan_get_current_block() returns a block.
+
+void plan_data_init (plan_line_data_t *plan_data);
+plan_block_t *plan_get_current_block (void);
+
+#endif
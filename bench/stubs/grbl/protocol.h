@@ -0,0 +1,7 @@
+/*
+
+  protocol.h - host stub, all declarations needed by the plugins are in hal.h
+
+*/
+
+#include "hal.h"
@@ -0,0 +1,20 @@
+/*
+
+  state_machine.h - host stub
+
+*/
+
+#ifndef _BENCH_STATE_MACHINE_H_
+#define _BENCH_STATE_MACHINE_H_
+
+#include "hal.h"
+
+#define STATE_IDLE          0
+#define STATE_CHECK_MODE    (1 << 1)
+#define STATE_CYCLE         (1 << 3)
+
+extern sys_state_t state_stub; // Returned by state_get(), STATE_CYCLE by default.
+
+sys_state_t state_get (void);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+
+  grbl_stubs.c - host implementation of the grblHAL core functions used by the laser plugins
+
+  Number conversion mirrors the behaviour of the grblHAL core (nuts_bolts.c) closely enough
+  for the plugins to produce identical output on the host.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "grbl/hal.h"
+#include "grbl/gcode.h"
+#include "grbl/motion_control.h"
+#include "grbl/state_machine.h"
+
+grbl_hal_t hal = {0};
+grbl_t grbl = {0};
+settings_t settings = { .spindle.rpm_max = 1000.0f };
+system_t sys = {0};
+parser_state_t gc_state = {0};
+uint32_t mc_line_count = 0;
+uint32_t mc_line_mismatch = 0;
+
+// Reads a signed decimal number without exponent, as the core does.
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr)
+{
+    char *ptr = line + *char_counter;
+    bool negative = false, found = false;
+    uint32_t intval = 0;
+    int_fast8_t exp = 0;
+    float fval;
+
+    if(*ptr == '-') {
+        negative = true;
+        ptr++;
+    } else if(*ptr == '+')
+        ptr++;
+
+    bool isdecimal = false;
+
+    while(true) {
+        char c = *ptr;
+        if(c >= '0' && c <= '9') {
+            found = true;
+            if(intval <= 214748364) {
+                intval = intval * 10 + (c - '0');
+                if(isdecimal)
+                    exp--;
+            } else if(!isdecimal)
+                exp++;
+        } else if(c == '.' && !isdecimal)
+            isdecimal = true;
+        else
+            break;
+        ptr++;
+    }
+
+    if(!found)
+        return false;
+
+    fval = (float)intval;
+    while(exp < 0) {
+        fval *= 0.1f;
+        exp++;
+    }
+    while(exp > 0) {
+        fval *= 10.0f;
+        exp--;
+    }
+
+    *float_ptr = negative ? -fval : fval;
+    *char_counter = ptr - line;
+
+    return true;
+}
+
+// Decimal point is always output, even if decimal_places is 0.
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[24];
+
+    int len = snprintf(buf, sizeof(buf) - 1, "%.*f", decimal_places, (double)n);
+
+    if(decimal_places == 0 && len > 0 && len < (int)sizeof(buf) - 1)
+        strcpy(buf + len, ".");
+
+    return buf;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[12];
+
+    snprintf(buf, sizeof(buf), "%u", (unsigned)n);
+
+    return buf;
+}
+
+// NVS is not persistent on the host, plugins will restore their default settings on load.
+
+static nvs_transfer_result_t memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpy_from_nvs (uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    return NVS_TransferResult_Failed;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    static nvs_address_t next = 1024;
+
+    hal.nvs.memcpy_to_nvs = memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = memcpy_from_nvs;
+
+    next += size + 1;
+
+    return next - size - 1;
+}
+
+static setting_details_t *setting_details[4];
+static uint_fast8_t n_setting_details = 0;
+
+// The core loads plugin settings after all plugins are initialized, here they are loaded on registration.
+void settings_register (setting_details_t *details)
+{
+    if(n_setting_details < sizeof(setting_details) / sizeof(setting_details_t *))
+        setting_details[n_setting_details++] = details;
+
+    if(details->load)
+        details->load();
+}
+
+const setting_detail_t *setting_get_details (setting_id_t id)
+{
+    for(uint_fast8_t i = 0; i < n_setting_details; i++) {
+        for(uint_fast8_t j = 0; j < setting_details[i]->n_settings; j++) {
+            if(setting_details[i]->settings[j].id == id)
+                return &setting_details[i]->settings[j];
+        }
+    }
+
+    return NULL;
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+void protocol_enqueue_rt_command (void (*fn)(uint_fast16_t state))
+{
+    fn(0);
+}
+
+void system_flag_wco_change (void)
+{
+}
+
+static spindle_ptrs_t spindle;
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle_ptrs, const char *name)
+{
+    memcpy(&spindle, spindle_ptrs, sizeof(spindle_ptrs_t));
+    spindle.id = 1;
+
+    return spindle.id;
+}
+
+spindle_ptrs_t *spindle_get_hal (spindle_id_t spindle_id, spindle_hal_t hal)
+{
+    return spindle_id == spindle.id ? &spindle : NULL;
+}
+
+// Linear spindle speed model, as the core.
+uint_fast16_t spindle_compute_pwm_value (spindle_pwm_t *pwm_data, float rpm, bool pid_limit)
+{
+    uint_fast16_t pwm_value;
+
+    if(rpm > pwm_data->rpm_min) {
+        pwm_value = (uint_fast16_t)floorf((rpm - pwm_data->rpm_min) * pwm_data->pwm_gradient) + pwm_data->min_value;
+        if(pwm_value >= pwm_data->max_value)
+            pwm_value = pwm_data->max_value;
+    } else if(rpm == 0.0f)
+        return pwm_data->off_value;
+    else
+        pwm_value = pwm_data->min_value;
+
+    return pwm_data->invert_pwm ? pwm_data->period - pwm_value - 1 : pwm_value;
+}
+
+void spindle_update_caps (spindle_ptrs_t *spindle, spindle_pwm_t *pwm_caps)
+{
+}
+
+bool plan_stub_empty = true;
+sys_state_t state_stub = STATE_CYCLE;
+
+void plan_data_init (plan_line_data_t *plan_data)
+{
+    memset(plan_data, 0, sizeof(plan_line_data_t));
+}
+
+plan_block_t *plan_get_current_block (void)
+{
+    static uint8_t block;
+
+    return plan_stub_empty ? NULL : (plan_block_t *)&block;
+}
+
+bool mc_line (float *target, plan_line_data_t *pl_data)
+{
+    mc_line_count++;
+
+    if(pl_data->condition.is_rpm_rate_adjusted != gc_state.is_rpm_rate_adjusted ||
+        pl_data->condition.spindle.value != gc_state.modal.spindle.value ||
+         pl_data->overrides.value != gc_state.modal.override_ctrl.value)
+        mc_line_mismatch++;
+
+    return !ABORTED;
+}
+
+sys_state_t state_get (void)
+{
+    return state_stub;
+}
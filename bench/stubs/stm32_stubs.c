@@ -0,0 +1,129 @@
+/*
+
+  stm32_stubs.c - host implementation of the STM32 HAL functions and timer registers used by pwm_switch.c
+
+  With LASER_PWM_SIM the laser PWM timer is simulated, output changes are recorded with the simulation time.
+
+  Clocks are as for a STM32F412 at 100 MHz, APB2 timers are clocked at 100 MHz and APB1 timers at 100 MHz (50 MHz x 2).
+
+*/
+
+#include <stdlib.h>
+
+#include "driver.h"
+
+TIM_TypeDef laser_pwm_timer = {0}, ppi_timer = {0};
+
+static bool laser_enable = false;
+
+#if LASER_PWM_SIM
+
+static struct {
+    bool pending;
+    uint64_t time_us;
+    sim_event_t last;
+    uint32_t size;
+    sim_trace_t trace;
+} sim = {0};
+
+static void sim_record (void)
+{
+    sim_event_t event = {
+        .time_us = sim.time_us,
+        .ccr = (uint16_t)laser_pwm_timer.CCR1,
+        .moe = !!(laser_pwm_timer.BDTR & TIM_BDTR_MOE),
+        .enable = laser_enable
+    };
+
+    sim.pending = false;
+
+    if(sim.trace.n_events && event.ccr == sim.last.ccr && event.moe == sim.last.moe && event.enable == sim.last.enable)
+        return;
+
+    if(sim.trace.n_events == sim.size) {
+        sim.size = sim.size ? sim.size * 2 : 1024;
+        if((sim.trace.event = realloc(sim.trace.event, sim.size * sizeof(sim_event_t))) == NULL)
+            abort();
+    }
+
+    sim.trace.event[sim.trace.n_events++] = sim.last = event;
+}
+
+// Register writes complete after the access returns, the state is recorded on the next access or flush.
+TIM_TypeDef *sim_laser_timer (void)
+{
+    if(sim.pending)
+        sim_record();
+
+    sim.pending = true;
+    sim.trace.accesses++;
+
+    return &laser_pwm_timer;
+}
+
+void sim_flush (void)
+{
+    if(sim.pending)
+        sim_record();
+}
+
+void sim_set_time (uint64_t time_us)
+{
+    sim_flush();
+    sim.time_us = time_us;
+}
+
+void sim_reset (void)
+{
+    sim_flush();
+    sim.trace.n_events = sim.trace.accesses = 0;
+}
+
+const sim_trace_t *sim_get_trace (void)
+{
+    sim_flush();
+
+    return &sim.trace;
+}
+
+#endif
+
+void laser_enable_out (bool on)
+{
+#if LASER_PWM_SIM
+    sim_flush();
+    laser_enable = on;
+    sim.pending = true;
+#else
+    laser_enable = on;
+#endif
+}
+
+bool laser_enable_in (void)
+{
+    return laser_enable;
+}
+
+void HAL_RCC_GetClockConfig (RCC_ClkInitTypeDef *clock, uint32_t *latency)
+{
+    clock->APB1CLKDivider = RCC_HCLK_DIV2;
+    clock->APB2CLKDivider = RCC_HCLK_DIV1;
+    *latency = 3;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq (void)
+{
+    return 50000000UL;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq (void)
+{
+    return 100000000UL;
+}
+
+void TIM_Base_SetConfig (TIM_TypeDef *timer, TIM_Base_InitTypeDef *init)
+{
+    timer->PSC = init->Prescaler;
+    timer->ARR = init->Period;
+    timer->EGR = TIM_EGR_UG;
+}
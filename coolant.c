@@ -25,23 +25,95 @@
 
 #if LASER_COOLANT_ENABLE
 
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
 #ifdef ARDUINO
 #include "../grbl/hal.h"
 #include "../grbl/protocol.h"
+#include "../grbl/planner.h"
+#include "../grbl/state_machine.h"
 #include "../grbl/nvs_buffer.h"
 #else
 #include "grbl/hal.h"
 #include "grbl/protocol.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
 #include "grbl/nvs_buffer.h"
 #endif
 
+#ifndef COOLANT_SAMPLE_INTERVAL
+#define COOLANT_SAMPLE_INTERVAL 100 // Coolant temperature sampling interval in milliseconds.
+#endif
+
+#ifndef COOLANT_SAMPLE_BUFFER
+#define COOLANT_SAMPLE_BUFFER 8 // Number of coolant temperature samples kept, must be a power of 2.
+#endif
+
+#ifndef COOLANT_RISE_INTERVAL
+#define COOLANT_RISE_INTERVAL 60000 // Coolant temperature rate of rise measurement interval in milliseconds.
+#endif
+
+#ifndef COOLANT_TEMP_RISE_SETTING
+#define COOLANT_TEMP_RISE_SETTING Setting_UserDefined_5
+#endif
+
+#ifndef COOLANT_FLOW_WINDOW
+#define COOLANT_FLOW_WINDOW 1000 // Coolant flow rate measurement window in milliseconds.
+#endif
+
+#ifndef COOLANT_FLOW_HYSTERESIS
+#define COOLANT_FLOW_HYSTERESIS 1.1f // Flow rate is ok again when above min flow times this factor.
+#endif
+
+#ifndef COOLANT_FLOW_START_WINDOW
+#define COOLANT_FLOW_START_WINDOW 5000 // Time in milliseconds allowed for flow to rise above min flow after coolant is turned on.
+#endif
+
+#ifndef COOLANT_FLOW_PULSES_SETTING
+#define COOLANT_FLOW_PULSES_SETTING Setting_UserDefined_4
+#endif
+
+#ifndef COOLANT_MIN_FLOW_SETTING
+#define COOLANT_MIN_FLOW_SETTING Setting_UserDefined_3
+#endif
+
+#ifndef COOLANT_DERATE_SETTING
+#define COOLANT_DERATE_SETTING Setting_UserDefined_2
+#endif
+
+#ifndef COOLANT_OPTIONS_SETTING
+#define COOLANT_OPTIONS_SETTING Setting_UserDefined_1
+#endif
+
+#ifndef COOLANT_DERATE_MIN_POWER
+#define COOLANT_DERATE_MIN_POWER 50 // Laser power in percent at the max coolant temperature when derating.
+#endif
+
+#ifndef COOLANT_TELEMETRY_SETTING
+#define COOLANT_TELEMETRY_SETTING Setting_UserDefined_0
+#endif
+
+#ifndef COOLANT_TELEMETRY_SIZE
+#define COOLANT_TELEMETRY_SIZE 128 // Number of telemetry records kept, must be a power of 2.
+#endif
+
+#ifndef COOLANT_TELEMETRY_MCODE
+#define COOLANT_TELEMETRY_MCODE 130
+#endif
+
+#define CoolantTelemetry_Dump ((user_mcode_t)COOLANT_TELEMETRY_MCODE)
+
+#ifndef COOLANT_DERATE_FEED_STEP
+#define COOLANT_DERATE_FEED_STEP 5 // Min feed override change in percent when derating, avoids replanning on temperature noise.
+#endif
+
 typedef union {
     uint8_t value;
     struct {
-        uint8_t enable : 1;
+        uint8_t derate_feed : 1,
+                unassigned  : 7;
     };
 } coolant_options_t;
 
@@ -53,27 +125,126 @@ typedef struct {
     float off_delay;
     uint8_t coolant_ok_port;
     uint8_t coolant_temp_port;
+    float temp_offset;
+    float temp_gain;
+    float max_temp_rise;
+    float flow_pulses;
+    float min_flow;
+    float derate_band;
+    uint16_t telemetry_interval;
 } coolant_settings_t;
 
-static uint32_t coolant_off, coolant_off_delay = 0;
+static uint32_t coolant_off, coolant_off_delay = 0, coolant_start, coolant_start_timeout;
+static volatile bool coolant_starting = false;
+static bool coolant_start_failed = false; // Set when coolant ok was not signalled within the start delay, cleared when coolant is switched off or started again.
 static uint8_t coolant_ok_port, coolant_temp_port;
 static bool coolant_on = false, monitor_on = false, can_monitor = false;
 static on_report_options_ptr on_report_options;
 static on_realtime_report_ptr on_realtime_report;
 static on_execute_realtime_ptr on_execute_realtime;
 static coolant_ptrs_t on_coolant_changed;
+static on_spindle_selected_ptr on_spindle_selected;
+static spindle_set_state_ptr spindle_set_state;
+static spindle_get_pwm_ptr spindle_get_pwm;
+static spindle_update_rpm_ptr spindle_update_rpm;
+static user_mcode_ptrs_t user_mcode;
+static bool laser_on = false, laser_dynamic = false;
 static nvs_address_t nvs_address;
 static coolant_settings_t coolant_settings;
 static uint8_t n_ain, n_din;
 static char max_aport[4], max_dport[4];
+static struct {
+    bool valid;
+    uint32_t last;
+    uint_fast8_t head;
+    int32_t sum;
+    int32_t value[COOLANT_SAMPLE_BUFFER];
+    float temp;
+} samples = {0};
+// Temperatures are in 0.1 degree units, computed from the sum of the sample buffer.
+static struct {
+    int32_t offset;     // Input value offset times COOLANT_SAMPLE_BUFFER.
+    int32_t gain;       // Gain from sample sum to temperature, 16.16 fixed point.
+    int32_t min;
+    int32_t max;
+    int32_t max_rise;   // Per COOLANT_RISE_INTERVAL.
+    int32_t temp;
+    int32_t rise_temp;
+    uint32_t rise_start;
+    bool rise_valid;
+} filter = {0};
+// Flow meter mode, pulses from the flow sensor are counted on the coolant ok port.
+static struct {
+    bool enabled;
+    bool ok;
+    volatile uint32_t pulses;
+    uint32_t pulses_prev;
+    uint32_t start;
+    float rate;         // L/min
+} flow = {0};
+// Laser power, and optionally feed rate, is scaled down when the temperature is in the derating band below max.
+static struct {
+    int32_t start;      // 0.1 degrees.
+    int32_t band;       // 0.1 degrees, 0 when disabled.
+    float power;
+    bool feed_active;
+    override_t feed_override;   // Feed override to restore when derating ends.
+    override_t feed_set;        // Feed override in effect after the last derating step.
+} derate = { .power = 1.0f };
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t coolant_on : 1,
+                coolant_ok : 1,
+                laser_on   : 1,
+                derating   : 1;
+    };
+} telemetry_flags_t;
+
+typedef struct {
+    uint32_t ms;
+    int16_t temp;           // 0.1 degrees.
+    uint16_t flow;          // 0.1 l/min.
+    uint8_t power;          // Derated laser power in percent.
+    telemetry_flags_t flags;
+} telemetry_record_t;
+
+static struct {
+    uint32_t last;
+    uint_fast16_t head;
+    uint_fast16_t count;
+    telemetry_record_t record[COOLANT_TELEMETRY_SIZE];
+} telemetry = {0};
+static const char *alarm_reason;
 
 static void coolant_lost_handler (uint8_t port, bool state)
 {
-    if(coolant_on && !coolant_off_delay)
+    if(state) {
+        if(coolant_starting) {
+            coolant_starting = false;
+            coolant_on = true;
+        }
+    } else if(coolant_on && !coolant_off_delay)
         system_set_exec_alarm(Alarm_AbortCycle);
 }
 
-// Start/stop tube coolant, wait for ok signal on start if delay is configured.
+static void flow_pulse_handler (uint8_t port, bool state)
+{
+    flow.pulses++;
+}
+
+static bool coolant_is_ok (void)
+{
+    return flow.enabled ? flow.ok : hal.port.wait_on_input(Port_Digital, coolant_ok_port, WaitMode_Immediate, 0.0f) == 1;
+}
+
+static void flow_warning_msg (uint_fast16_t state)
+{
+    report_message("Coolant ok port does not support interrupts, flow meter disabled!", Message_Warning);
+}
+
+// Start/stop tube coolant. If a start delay is configured the ok signal is awaited by coolant_poll_realtime(),
+// or by coolant_lost_handler() when the input supports interrupts on both edges.
 static void coolantSetState (coolant_state_t mode)
 {
     static bool irq_checked = false;
@@ -90,20 +261,23 @@ static void coolantSetState (coolant_state_t mode)
             return;
         }
 
-        coolant_on = false;
+        coolant_on = coolant_starting = false;
     }
 
+    if(!mode.flood)
+        coolant_start_failed = false;
+
     on_coolant_changed.set_state(mode);
 
     if(changed && mode.flood) {
         coolant_off_delay = 0;
-        if(coolant_settings.on_delay > 0.0f && hal.port.wait_on_input(Port_Digital, coolant_ok_port, WaitMode_High, coolant_settings.on_delay) != 1) {
-            mode.flood = Off;
-            coolant_on = false;
-            on_coolant_changed.set_state(mode);
-            system_set_exec_alarm(Alarm_AbortCycle);
-        }
-        coolant_on = true;
+        coolant_start_failed = false;
+        coolant_start = hal.get_elapsed_ticks();
+        if(coolant_settings.on_delay > 0.0f) {
+            coolant_start_timeout = (uint32_t)(coolant_settings.on_delay * 1000.0f);
+            coolant_starting = true;
+        } else
+            coolant_on = true;
     }
 
     if(!irq_checked) {
@@ -112,18 +286,221 @@ static void coolantSetState (coolant_state_t mode)
 
         if(hal.port.get_pin_info) {
             xbar_t *port = hal.port.get_pin_info(Port_Digital, Port_Input, coolant_ok_port);
-            if(port && (port->cap.irq_mode & IRQ_Mode_Falling))
-                hal.port.register_interrupt_handler(coolant_ok_port, IRQ_Mode_Falling, coolant_lost_handler);
+            if(flow.enabled) {
+                if(!(port && (port->cap.irq_mode & IRQ_Mode_Rising) &&
+                      hal.port.register_interrupt_handler(coolant_ok_port, IRQ_Mode_Rising, flow_pulse_handler))) {
+                    flow.enabled = false;
+                    protocol_enqueue_rt_command(flow_warning_msg);
+                }
+            } else if(port) {
+                // Fall back to the falling edge only, the coolant lost alarm, if both edges are not supported.
+                if(!((port->cap.irq_mode & IRQ_Mode_Change) == IRQ_Mode_Change &&
+                      hal.port.register_interrupt_handler(coolant_ok_port, IRQ_Mode_Change, coolant_lost_handler)) &&
+                       (port->cap.irq_mode & IRQ_Mode_Falling))
+                    hal.port.register_interrupt_handler(coolant_ok_port, IRQ_Mode_Falling, coolant_lost_handler);
+            }
+        }
+    }
+
+    monitor_on = mode.flood && (coolant_settings.min_temp + coolant_settings.max_temp + coolant_settings.max_temp_rise) > 0.0f;
+}
+
+static void alarm_msg (uint_fast16_t state)
+{
+    report_message(alarm_reason, Message_Warning);
+}
+
+static void coolant_alarm (const char *reason)
+{
+    monitor_on = false;
+    alarm_reason = reason;
+    system_set_exec_alarm(Alarm_AbortCycle);
+    protocol_enqueue_rt_command(alarm_msg);
+}
+
+// Precomputes the fixed point temperature conversion and alarm thresholds from the settings.
+static void coolant_filter_config (void)
+{
+    filter.offset = lroundf(coolant_settings.temp_offset * (float)COOLANT_SAMPLE_BUFFER);
+    filter.gain = lroundf(coolant_settings.temp_gain * 10.0f * 65536.0f / (float)COOLANT_SAMPLE_BUFFER);
+    filter.min = lroundf(coolant_settings.min_temp * 10.0f);
+    filter.max = lroundf(coolant_settings.max_temp * 10.0f);
+    filter.max_rise = lroundf(coolant_settings.max_temp_rise * 10.0f * (float)COOLANT_RISE_INTERVAL / 60000.0f);
+    filter.rise_valid = false;
+    derate.band = filter.max ? lroundf(coolant_settings.derate_band * 10.0f) : 0;
+    derate.start = filter.max - derate.band;
+}
+
+// Calculates the laser power factor from the temperature in the derating band, the feed override is
+// scaled by the same factor if enabled. The feed override in effect when derating started, or as last
+// changed by the operator while derating, is restored after unless the operator has changed it since.
+static void coolant_derate (void)
+{
+    float power = 1.0f;
+    int32_t feed_override;
+
+    if(monitor_on && derate.band && filter.temp > derate.start)
+        power -= (1.0f - (float)COOLANT_DERATE_MIN_POWER / 100.0f) * (float)min(filter.temp - derate.start, derate.band) / (float)derate.band;
+
+    if(power != derate.power) {
+        derate.power = power;
+        // The derated power is otherwise only output on the next spindle update. Segments prepared from now on are
+        // recalculated, with no motion the constant power (M3) output is updated directly.
+        if(laser_on) {
+            sys.step_control.update_spindle_rpm = On;
+            if(!laser_dynamic && spindle_update_rpm && state_get() == STATE_IDLE)
+                spindle_update_rpm(sys.spindle_rpm * power);
+        }
+    }
+
+    if(coolant_settings.options.derate_feed) {
+        if(power < 1.0f) {
+            if(!derate.feed_active || sys.override.feed_rate != derate.feed_set) {
+                derate.feed_active = true;
+                derate.feed_override = sys.override.feed_rate;
+            }
+            feed_override = lroundf((float)derate.feed_override * power);
+            if(abs(feed_override - (int32_t)sys.override.feed_rate) >= COOLANT_DERATE_FEED_STEP)
+                plan_feed_override((override_t)feed_override, sys.override.rapid_rate);
+            derate.feed_set = sys.override.feed_rate;
+        } else if(derate.feed_active) {
+            derate.feed_active = false;
+            if(sys.override.feed_rate == derate.feed_set)
+                plan_feed_override(derate.feed_override, sys.override.rapid_rate);
+        }
+    }
+}
+
+// Checks the filtered temperature against the alarm thresholds, the rate of rise is measured
+// over COOLANT_RISE_INTERVAL ms from when monitoring is started.
+static void coolant_check_temp (uint32_t ms)
+{
+    coolant_derate();
+
+    if(!monitor_on) {
+        filter.rise_valid = false;
+        return;
+    }
+
+    if(filter.max && filter.temp > filter.max)
+        coolant_alarm("Coolant temperature above max");
+    else if(filter.min && filter.temp < filter.min)
+        coolant_alarm("Coolant temperature below min");
+    else if(filter.max_rise) {
+        if(filter.rise_valid && ms - filter.rise_start >= COOLANT_RISE_INTERVAL) {
+            if(filter.temp - filter.rise_temp > filter.max_rise)
+                coolant_alarm("Coolant temperature rising too fast");
+            filter.rise_valid = false;
+        }
+        if(!filter.rise_valid) {
+            filter.rise_valid = true;
+            filter.rise_start = ms;
+            filter.rise_temp = filter.temp;
         }
     }
+}
+
+// Reads the coolant temperature input into the sample buffer, called every COOLANT_SAMPLE_INTERVAL ms.
+// The temperature is the moving average of the buffer, the buffer is filled with the first sample read.
+static void coolant_sample (uint32_t ms)
+{
+    uint_fast8_t idx;
+    int32_t value = hal.port.wait_on_input(Port_Analog, coolant_temp_port, WaitMode_Immediate, 0.0f);
+
+    if(value >= 0) {
+
+        if(!samples.valid) {
+            samples.valid = true;
+            samples.sum = 0;
+            for(idx = 0; idx < COOLANT_SAMPLE_BUFFER; idx++) {
+                samples.value[idx] = value;
+                samples.sum += value;
+            }
+        }
 
-    monitor_on = mode.flood && (coolant_settings.min_temp + coolant_settings.max_temp) > 0.0f;
+        samples.sum += value - samples.value[samples.head];
+        samples.value[samples.head] = value;
+        samples.head = (samples.head + 1) & (COOLANT_SAMPLE_BUFFER - 1);
+
+        filter.temp = (int32_t)(((int64_t)(samples.sum - filter.offset) * filter.gain) >> 16);
+        samples.temp = (float)filter.temp / 10.0f;
+
+        coolant_check_temp(ms);
+    }
+}
+
+// Calculates the flow rate from the pulses counted since the last call, raises an alarm when
+// it drops below the min flow while coolant is on or has not risen above it when the start window
+// ends, also when no on delay is set. Flow is ok again above min flow with hysteresis.
+static void coolant_flow_update (uint32_t ms)
+{
+    uint32_t pulses = flow.pulses;
+    bool ok = flow.ok, started = (int32_t)(flow.start - coolant_start) >= COOLANT_FLOW_START_WINDOW;
+
+    flow.rate = (float)(pulses - flow.pulses_prev) * 60000.0f / ((float)(ms - flow.start) * coolant_settings.flow_pulses);
+    flow.pulses_prev = pulses;
+    flow.start = ms;
+
+    if(flow.ok)
+        flow.ok = flow.rate >= coolant_settings.min_flow;
+    else
+        flow.ok = flow.rate >= coolant_settings.min_flow * COOLANT_FLOW_HYSTERESIS && flow.rate > 0.0f;
+
+    if(!flow.ok && coolant_on && !coolant_off_delay && (ok || (!started && ms - coolant_start >= COOLANT_FLOW_START_WINDOW)))
+        coolant_alarm(ok ? "Coolant flow too low" : "Coolant flow did not start");
+}
+
+// Adds a record to the telemetry ring, the oldest record is overwritten when full.
+static void coolant_telemetry_add (uint32_t ms)
+{
+    telemetry_record_t *record = &telemetry.record[telemetry.head];
+
+    record->ms = ms;
+    record->temp = can_monitor ? (int16_t)filter.temp : 0;
+    record->flow = flow.enabled ? (uint16_t)lroundf(flow.rate * 10.0f) : 0;
+    record->power = (uint8_t)lroundf(derate.power * 100.0f);
+    record->flags.coolant_on = coolant_on;
+    record->flags.coolant_ok = coolant_is_ok();
+    record->flags.laser_on = laser_on;
+    record->flags.derating = derate.power < 1.0f;
+
+    telemetry.head = (telemetry.head + 1) & (COOLANT_TELEMETRY_SIZE - 1);
+    if(telemetry.count < COOLANT_TELEMETRY_SIZE)
+        telemetry.count++;
 }
 
 static void coolant_poll_realtime (sys_state_t state)
 {
     on_execute_realtime(state);
 
+    if(coolant_settings.telemetry_interval && hal.get_elapsed_ticks() - telemetry.last >= coolant_settings.telemetry_interval) {
+        telemetry.last = hal.get_elapsed_ticks();
+        coolant_telemetry_add(telemetry.last);
+    }
+
+    if(can_monitor && hal.get_elapsed_ticks() - samples.last >= COOLANT_SAMPLE_INTERVAL) {
+        samples.last = hal.get_elapsed_ticks();
+        coolant_sample(samples.last);
+    }
+
+    if(flow.enabled && hal.get_elapsed_ticks() - flow.start >= COOLANT_FLOW_WINDOW)
+        coolant_flow_update(hal.get_elapsed_ticks());
+
+    if(coolant_starting) {
+        if(coolant_is_ok()) {
+            coolant_starting = false;
+            coolant_on = true;
+        } else if(hal.get_elapsed_ticks() - coolant_start >= coolant_start_timeout) {
+            coolant_state_t mode = hal.coolant.get_state();
+            mode.flood = Off;
+            on_coolant_changed.set_state(mode);
+            coolant_starting = false;
+            coolant_start_failed = true;
+            sys.report.coolant = On; // Set to report change immediately
+            coolant_alarm("Coolant did not start");
+        }
+    }
+
     if(coolant_off_delay && hal.get_elapsed_ticks() - coolant_off > coolant_off_delay) {
 
         coolant_state_t mode = hal.coolant.get_state();
@@ -135,26 +512,79 @@ static void coolant_poll_realtime (sys_state_t state)
     }
 }
 
-static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+// Holds laser on until coolant has started, queued motions are executed while waiting.
+// The alarm raised on a start timeout is not an abort, the laser is not switched on unless coolant reached ok.
+static void laserSetState (spindle_state_t state, float rpm)
 {
-    static float coolant_temp_prev = 0.0f;
+    bool ok = true;
+
+    if(state.on) {
+        while(coolant_starting && (ok = protocol_execute_realtime()));
+        ok = ok && !coolant_start_failed && !sys.rt_exec_alarm && !(state_get() & STATE_ALARM);
+    }
 
-    char buf[20] = "";
+    if(ok) {
+        laser_on = state.on;
+        laser_dynamic = state.ccw;
+        spindle_set_state(state, rpm * derate.power);
+    }
+}
 
-    *buf = '\0';
+static uint_fast16_t laserGetPWM (float rpm)
+{
+    return spindle_get_pwm(rpm * derate.power);
+}
 
-    if(can_monitor) {
+static void laserUpdateRPM (float rpm)
+{
+    spindle_update_rpm(rpm * derate.power);
+}
 
-        float coolant_temp = (float)hal.port.wait_on_input(Port_Analog, coolant_temp_port, WaitMode_Immediate, 0.0f) / 10.0f;
+static void onSpindleSelected (spindle_ptrs_t *spindle)
+{
+    if(on_spindle_selected)
+        on_spindle_selected(spindle);
 
-        if(coolant_temp_prev != coolant_temp || report.all) {
-            strcat(buf, "|TCT:");
-            strcat(buf, ftoa(coolant_temp, 1));
-            coolant_temp_prev = coolant_temp;
+    if(spindle->cap.laser) {
+        if(spindle->set_state != laserSetState) {
+            spindle_set_state = spindle->set_state;
+            spindle->set_state = laserSetState;
+        }
+        if(spindle->get_pwm && spindle->get_pwm != laserGetPWM) {
+            spindle_get_pwm = spindle->get_pwm;
+            spindle->get_pwm = laserGetPWM;
         }
+        if(spindle->update_rpm && spindle->update_rpm != laserUpdateRPM) {
+            spindle_update_rpm = spindle->update_rpm;
+            spindle->update_rpm = laserUpdateRPM;
+        }
+    }
+}
 
-        if(monitor_on && coolant_temp > coolant_settings.max_temp)
-            system_set_exec_alarm(Alarm_AbortCycle);
+static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    static float coolant_temp_prev = 0.0f, flow_prev = 0.0f, derate_prev = 1.0f;
+
+    char buf[50] = "";
+
+    *buf = '\0';
+
+    if(can_monitor && (coolant_temp_prev != samples.temp || report.all)) {
+        strcat(buf, "|TCT:");
+        strcat(buf, ftoa(samples.temp, 1));
+        coolant_temp_prev = samples.temp;
+    }
+
+    if(derate.band && (derate_prev != derate.power || report.all)) {
+        strcat(buf, "|DRT:");
+        strcat(buf, uitoa((uint32_t)lroundf(derate.power * 100.0f)));
+        derate_prev = derate.power;
+    }
+
+    if(flow.enabled && (flow_prev != flow.rate || report.all)) {
+        strcat(buf, "|FLO:");
+        strcat(buf, ftoa(flow.rate, 1));
+        flow_prev = flow.rate;
     }
 
     if(*buf != '\0')
@@ -164,17 +594,88 @@ static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_fla
         on_realtime_report(stream_write, report);
 }
 
+// Outputs the telemetry ring, oldest record first, as [TLM:<ms>,<temp>,<flow>,<power>,<flags>] lines.
+// Temperature and flow are in 0.1 units, flags bits are coolant on, coolant ok, laser on and derating.
+static void coolant_telemetry_dump (void)
+{
+    char buf[50];
+    telemetry_record_t *record;
+    uint_fast16_t idx = (telemetry.head - telemetry.count) & (COOLANT_TELEMETRY_SIZE - 1), n = telemetry.count;
+
+    while(n--) {
+        record = &telemetry.record[idx];
+        strcpy(buf, "[TLM:");
+        strcat(buf, uitoa(record->ms));
+        strcat(buf, ",");
+        if(record->temp < 0)
+            strcat(buf, "-");
+        strcat(buf, uitoa((uint32_t)abs(record->temp)));
+        strcat(buf, ",");
+        strcat(buf, uitoa(record->flow));
+        strcat(buf, ",");
+        strcat(buf, uitoa(record->power));
+        strcat(buf, ",");
+        strcat(buf, uitoa(record->flags.value));
+        strcat(buf, "]" ASCII_EOL);
+        hal.stream.write(buf);
+        idx = (idx + 1) & (COOLANT_TELEMETRY_SIZE - 1);
+    }
+}
+
+static user_mcode_t userMCodeCheck (user_mcode_t mcode)
+{
+    return mcode == CoolantTelemetry_Dump
+            ? mcode
+            : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Ignore);
+}
+
+static status_code_t userMCodeValidate (parser_block_t *gc_block, parameter_words_t *deprecated)
+{
+    status_code_t state = Status_Unhandled;
+
+    if(gc_block->user_mcode == CoolantTelemetry_Dump) {
+        if(gc_block->words.p) {
+            state = isnan(gc_block->values.p) ? Status_BadNumberFormat : Status_OK;
+            gc_block->words.p = Off;
+        } else
+            state = Status_OK;
+    }
+
+    return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block, deprecated) : state;
+}
+
+static void userMCodeExecute (uint_fast16_t state, parser_block_t *gc_block)
+{
+    if(gc_block->user_mcode == CoolantTelemetry_Dump) {
+        if(state != STATE_CHECK_MODE) {
+            coolant_telemetry_dump();
+            if(gc_block->values.p != 0.0f)
+                telemetry.count = 0;
+        }
+    } else if(user_mcode.execute)
+        user_mcode.execute(state, gc_block);
+}
+
 static bool is_setting_available (const setting_detail_t *setting)
 {
-    return (setting->id == Setting_CoolantMaxTemp || setting->id == Setting_CoolantTempPort) && n_ain > 0;
+    return (setting->id == Setting_CoolantMinTemp || setting->id == Setting_CoolantMaxTemp || setting->id == Setting_CoolantOffset ||
+             setting->id == Setting_CoolantGain || setting->id == COOLANT_DERATE_SETTING || setting->id == COOLANT_OPTIONS_SETTING || setting->id == COOLANT_TEMP_RISE_SETTING || setting->id == Setting_CoolantTempPort) && n_ain > 0;
 }
 
 static const setting_detail_t plugin_settings[] = {
     { Setting_CoolantOnDelay, Group_Coolant, "Laser coolant on delay", "seconds", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.on_delay, NULL, NULL },
     { Setting_CoolantOffDelay, Group_Coolant, "Laser coolant off delay", "minutes", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.off_delay, NULL, NULL },
-//    { Setting_CoolantMinTemp, Group_Coolant, "Laser coolant min temp", "deg", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.min_temp, NULL, NULL, false },
+    { Setting_CoolantMinTemp, Group_Coolant, "Laser coolant min temp", "deg", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.min_temp, NULL, is_setting_available },
     { Setting_CoolantMaxTemp, Group_Coolant, "Laser coolant max temp", "deg", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.max_temp, NULL, is_setting_available },
+    { COOLANT_DERATE_SETTING, Group_Coolant, "Laser coolant derating band", "deg", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.derate_band, NULL, is_setting_available },
+    { COOLANT_OPTIONS_SETTING, Group_Coolant, "Laser coolant options", NULL, Format_Bitfield, "Derate feed rate", NULL, NULL, Setting_NonCore, &coolant_settings.options, NULL, is_setting_available },
+    { COOLANT_TEMP_RISE_SETTING, Group_Coolant, "Laser coolant max temp rise", "deg/min", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &coolant_settings.max_temp_rise, NULL, is_setting_available },
+    { Setting_CoolantOffset, Group_Coolant, "Laser coolant temp offset", NULL, Format_Decimal, "-###0.0", "-9999.0", "9999.0", Setting_NonCore, &coolant_settings.temp_offset, NULL, is_setting_available },
+    { Setting_CoolantGain, Group_Coolant, "Laser coolant temp gain", NULL, Format_Decimal, "#0.0000", "0.0", "10.0", Setting_NonCore, &coolant_settings.temp_gain, NULL, is_setting_available },
     { Setting_CoolantTempPort, Group_AuxPorts, "Coolant temperature port", NULL, Format_Int8, "#0", "0", max_aport, Setting_NonCore, &coolant_settings.coolant_temp_port, NULL, is_setting_available, { .reboot_required = On } },
+    { COOLANT_TELEMETRY_SETTING, Group_Coolant, "Laser coolant telemetry interval", "milliseconds", Format_Int16, "####0", "0", "60000", Setting_NonCore, &coolant_settings.telemetry_interval, NULL, NULL },
+    { COOLANT_FLOW_PULSES_SETTING, Group_Coolant, "Laser coolant flow meter pulses", "pulses/l", Format_Decimal, "###0.0", "0.0", "10000.0", Setting_NonCore, &coolant_settings.flow_pulses, NULL, NULL, { .reboot_required = On } },
+    { COOLANT_MIN_FLOW_SETTING, Group_Coolant, "Laser coolant min flow", "l/min", Format_Decimal, "#0.0", "0.0", "100.0", Setting_NonCore, &coolant_settings.min_flow, NULL, NULL },
     { Setting_CoolantOkPort, Group_AuxPorts, "Coolant ok port", NULL, Format_Int8, "#0", "0", max_dport, Setting_NonCore, &coolant_settings.coolant_ok_port, NULL, NULL, { .reboot_required = On } }
 };
 
@@ -183,8 +684,17 @@ static const setting_detail_t plugin_settings[] = {
 static const setting_descr_t plugin_settings_descr[] = {
     { Setting_CoolantOnDelay, "" },
     { Setting_CoolantOffDelay, "" },
-    { Setting_CoolantMaxTemp, "" },
+    { Setting_CoolantMinTemp, "Alarm is raised if the coolant temperature drops below this value while coolant is on, 0 to disable." },
+    { Setting_CoolantMaxTemp, "Alarm is raised if the coolant temperature exceeds this value while coolant is on, 0 to disable." },
+    { COOLANT_DERATE_SETTING, "Laser power is scaled down linearly to the derating min power when the coolant temperature rises through this band below max temp, 0 to disable." },
+    { COOLANT_OPTIONS_SETTING, "Derate feed rate scales the feed override by the same factor as laser power when derating." },
+    { COOLANT_TEMP_RISE_SETTING, "Alarm is raised if the coolant temperature rises faster than this while coolant is on, 0 to disable." },
+    { Setting_CoolantOffset, "Temperature input value at 0 degrees." },
+    { Setting_CoolantGain, "Degrees per temperature input value step." },
     { Setting_CoolantTempPort, "Aux port number to use for coolant temperature monitoring." },
+    { COOLANT_TELEMETRY_SETTING, "Interval between telemetry records, 0 to disable. The records are output by the telemetry M-code, M130 by default." },
+    { COOLANT_FLOW_PULSES_SETTING, "Flow meter pulses per liter, the flow meter pulse output is connected to the coolant ok port. 0 for a coolant ok level signal." },
+    { COOLANT_MIN_FLOW_SETTING, "Coolant is ok when the flow rate is above this value. Alarm is raised if it drops below while coolant is on." },
     { Setting_CoolantOkPort, "Aux port number to use for coolant ok signal." },
 };
 
@@ -192,6 +702,7 @@ static const setting_descr_t plugin_settings_descr[] = {
 
 static void coolant_settings_save (void)
 {
+    coolant_filter_config();
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&coolant_settings, sizeof(coolant_settings_t), true);
 }
 
@@ -200,7 +711,15 @@ static void coolant_settings_restore (void)
     coolant_settings.min_temp =
     coolant_settings.max_temp =
     coolant_settings.on_delay =
-    coolant_settings.off_delay = 0.0f;
+    coolant_settings.off_delay =
+    coolant_settings.max_temp_rise =
+    coolant_settings.temp_offset =
+    coolant_settings.flow_pulses =
+    coolant_settings.min_flow =
+    coolant_settings.derate_band = 0.0f;
+    coolant_settings.options.value = 0;
+    coolant_settings.telemetry_interval = 0;
+    coolant_settings.temp_gain = 0.1f;
 
     if(ioport_can_claim_explicit()) {
         coolant_settings.coolant_temp_port = n_ain ? n_ain - 1 : 0;
@@ -217,6 +736,9 @@ static void coolant_settings_load (void)
     if(hal.nvs.memcpy_from_nvs((uint8_t *)&coolant_settings, nvs_address, sizeof(coolant_settings_t), true) != NVS_TransferResult_OK)
         coolant_settings_restore();
 
+    coolant_filter_config();
+    flow.enabled = coolant_settings.flow_pulses > 0.0f;
+
     if(ioport_can_claim_explicit()) {
 
         // Sanity checks
@@ -242,6 +764,15 @@ static void coolant_settings_load (void)
         on_execute_realtime = grbl.on_execute_realtime;
         grbl.on_execute_realtime = coolant_poll_realtime;
 
+        on_spindle_selected = grbl.on_spindle_selected;
+        grbl.on_spindle_selected = onSpindleSelected;
+
+        memcpy(&user_mcode, &hal.user_mcode, sizeof(user_mcode_ptrs_t));
+
+        hal.user_mcode.check = userMCodeCheck;
+        hal.user_mcode.validate = userMCodeValidate;
+        hal.user_mcode.execute = userMCodeExecute;
+
         memcpy(&on_coolant_changed, &hal.coolant, sizeof(coolant_ptrs_t));
         hal.coolant.set_state = coolantSetState;
     }
@@ -264,7 +795,7 @@ static void report_options (bool newopt)
     on_report_options(newopt);
 
     if(!newopt)
-        hal.stream.write("[PLUGIN:Laser coolant v0.04]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:Laser coolant v0.10]" ASCII_EOL);
 }
 
 static void warning_msg (uint_fast16_t state)
@@ -30,35 +30,97 @@
 #include "grbl/hal.h"
 #include "grbl/gcode.h"
 #include "grbl/protocol.h"
+#include "grbl/nvs_buffer.h"
+#if LB_CLUSTERS_DIRECT
+#include "grbl/motion_control.h"
+#include "grbl/state_machine.h"
+#endif
 
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef LB_CLUSTER_SIZE
-#define LB_CLUSTER_SIZE 16
+#define LB_CLUSTER_SIZE 16 // Default and minimum cluster capacity, larger capacities are allocated at startup.
+#endif
+
+#ifndef LB_CLUSTERS_DIRECT
+#define LB_CLUSTERS_DIRECT 0 // Change to 1 to send cluster elements following the first directly to the planner.
+#endif
+
+#ifndef LB_CLUSTER_SIZE_SETTING
+#define LB_CLUSTER_SIZE_SETTING Setting_UserDefined_9
+#endif
+
+#if LB_CLUSTERS_DIRECT && SIENCI_LASER_PWM && LASER_RASTER_ENABLE
+#define LB_CLUSTERS_RASTER 1 // Elements following the first are queued as a raster line for the SLB laser.
+#include "pwm_switch.h"
+#else
+#define LB_CLUSTERS_RASTER 0
 #endif
 
 #ifndef LB_SVALUE_SCALING
 #define LB_SVALUE_SCALING 0 // Change to 1 if S-values is to be multiplied by $30 value (max RPM).
 #endif
 
+#ifndef LB_CLUSTERS_BINARY
+#define LB_CLUSTERS_BINARY 0 // Change to 1 to accept base64 encoded 8-bit S-values, G1X<distance>S@<base64>.
+#endif
+
+typedef struct {
+    char *s;
+    uint_fast16_t length;
+} lb_slice_t;
+
 static struct {
     char block[LINE_BUFFER_SIZE];
     char *s;
-    char *cmd;
     char eol;
     uint_fast16_t length;
 } input = {0};
 
+// Cluster elements are not copied, the S values are served directly from input.block
+// by recording their offsets and lengths when the line is parsed.
 static struct {
-    char block[34];
-    char param[24];
-    char sval[LB_CLUSTER_SIZE][10];
-    char *s;
-    char *cmd;
+    char cmd[34];                           // G1 command with axis value divided by number of elements, terminated by S.
+    char param[24];                         // Additional words, only output with the first element.
+    uint16_t *sval_offset;                  // Offset of S value in input.block.
+    uint8_t *sval_length;                   // Length of S value.
+    uint_fast16_t size;                     // Capacity of sval_offset and sval_length.
+    uint_fast8_t cmd_length;
+    uint_fast8_t param_length;
     uint_fast16_t count;
     uint_fast16_t next;
+    status_code_t status;                   // Error to report in place of "ok" for a line rejected by the decoder.
+#if LB_CLUSTERS_BINARY
+    uint8_t *data;                          // Decoded S values when binary encoded, NULL for ASCII clusters.
+#endif
+#if LB_CLUSTERS_BINARY || LB_SVALUE_SCALING
+    char sval[10];                          // Converted S value.
+#endif
+#if LB_CLUSTERS_DIRECT
+    float start[N_AXIS];                    // Parser position before the first element.
+#endif
 } cluster;
 
+typedef struct {
+    uint8_t cluster_size;
+} lb_clusters_settings_t;
+
+static uint16_t sval_offset[LB_CLUSTER_SIZE];
+static uint8_t sval_length[LB_CLUSTER_SIZE];
+static nvs_address_t nvs_address;
+static lb_clusters_settings_t lb_settings;
+
+// Characters delivered to hal.stream.read are served from a list of slices,
+// for a cluster element these are: command prefix, S value, parameters (first element only) and EOL.
+static struct {
+    char *s;
+    uint_fast16_t length;
+    lb_slice_t slice[4];
+    uint_fast8_t idx;
+    uint_fast8_t n;
+} output = {0};
+
 static stream_read_ptr file_read = NULL, stream_read = NULL;
 static on_stream_changed_ptr on_stream_changed;
 static on_report_handlers_init_ptr on_report_handlers_init;
@@ -66,33 +128,331 @@ static status_message_ptr status_message = NULL;
 static on_report_options_ptr on_report_options;
 static on_reset_ptr on_reset;
 
-static inline char *get_value (char *v, uint_fast8_t *offset, uint_fast16_t scale)
+#if LB_CLUSTERS_BINARY || LB_SVALUE_SCALING
+
+static char *s_value_str (uint32_t value, uint_fast16_t *length)
 {
-    float val;
+    char *s = cluster.sval + sizeof(cluster.sval);
+
+    do {
+        *--s = '0' + value % 10;
+    } while(value /= 10);
 
-    read_float(v, offset, &val);
+    *length = cluster.sval + sizeof(cluster.sval) - s;
 
-    return ftoa(val / (float)scale, 8);
+    return s;
 }
 
+#endif
+
 #if LB_SVALUE_SCALING
 
-static inline char *get_s_value (char *v)
+#define S_SCALE_FRACTION_DIGITS 6
+#define S_SCALE_DIVISOR 1000000UL // 10^S_SCALE_FRACTION_DIGITS
+#define S_SCALE_SHIFT 32
+
+// $30 (max RPM) split in integer and 0.32 fixed point fraction parts for the integer part of S values,
+// divided by S_SCALE_DIVISOR in fixed point for the fraction part and by 255 for binary values.
+static uint32_t s_scale_int, s_scale_frac, s_scale, s_scale_binary;
+static settings_changed_ptr settings_changed;
+
+static void s_scale_update (void)
 {
-    char *s;
+    uint64_t rpm_max = (uint64_t)(settings.spindle.rpm_max * 1000.0f + 0.5f); // in 1/1000 RPM
+
+    s_scale_int = (uint32_t)(rpm_max / 1000UL);
+    s_scale_frac = (uint32_t)((((rpm_max % 1000UL) << S_SCALE_SHIFT) + 999UL) / 1000UL);
+    // Rounded up so that exact halves are rounded up when scaled.
+    s_scale = (uint32_t)(((rpm_max << S_SCALE_SHIFT) + S_SCALE_DIVISOR * 1000UL - 1) / (S_SCALE_DIVISOR * 1000UL));
+    s_scale_binary = (uint32_t)(((rpm_max << 16) + 255000UL - 1) / 255000UL);
+}
+
+// Returns the S value multiplied by $30 rounded to an integer, the value is read with
+// S_SCALE_FRACTION_DIGITS decimals and scaled in fixed point. The integer and fraction
+// parts are scaled separately so that integer S values are exact when $30 is an integer,
+// results not fitting in 32 bits are clamped to UINT32_MAX.
+static uint32_t get_s_scaled (const char *v)
+{
+    char c;
+    uint32_t val = 0, frac = 0;
+    int_fast8_t decimals = -1;
+
+    while(true) {
+        c = *v++;
+        if(c >= '0' && c <= '9') {
+            if(decimals < 0)
+                val = val > (UINT32_MAX - (c - '0')) / 10 ? UINT32_MAX : val * 10 + (c - '0');
+            else if(decimals < S_SCALE_FRACTION_DIGITS) {
+                frac = frac * 10 + (c - '0');
+                decimals++;
+            } else if(decimals == S_SCALE_FRACTION_DIGITS) {
+                if(c >= '5')
+                    frac++;
+                decimals++;
+            }
+        } else if(c == '.' && decimals < 0)
+            decimals = 0;
+        else
+            break;
+    }
+
+    if(decimals > S_SCALE_FRACTION_DIGITS)
+        decimals = S_SCALE_FRACTION_DIGITS;
+    else if(decimals < 0)
+        decimals = 0;
+
+    while(decimals++ < S_SCALE_FRACTION_DIGITS)
+        frac *= 10;
+
+    uint64_t scaled = (uint64_t)val * s_scale_int +
+                       (((uint64_t)val * s_scale_frac + (uint64_t)frac * s_scale + (1ULL << (S_SCALE_SHIFT - 1))) >> S_SCALE_SHIFT);
+
+    return scaled > UINT32_MAX ? UINT32_MAX : (uint32_t)scaled;
+}
+
+static inline uint32_t get_s_binary_scaled (uint8_t value)
+{
+    return (uint32_t)(((uint64_t)value * s_scale_binary + 0x8000) >> 16);
+}
+
+static inline char *get_s_value (char *v, uint_fast16_t *length)
+{
+    return s_value_str(get_s_scaled(v), length);
+}
+
+static void onSettingsChanged (settings_t *settings, settings_changed_flags_t changed)
+{
+    if(settings_changed)
+        settings_changed(settings, changed);
+
+    s_scale_update();
+}
+
+#endif
+
+#if LB_CLUSTERS_BINARY
+
+static inline int_fast8_t base64_value (char c)
+{
+    if(c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if(c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if(c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if(c == '+')
+        return 62;
+    if(c == '/')
+        return 63;
+
+    return -1;
+}
+
+// Decode base64 data in place, decoding stops at the first '=' or EOL.
+// Returns number of bytes decoded or 0 if invalid.
+static uint_fast16_t base64_decode (char *s)
+{
+    char c;
+    int_fast8_t v;
+    uint_fast8_t bits = 0;
+    uint_fast16_t acc = 0, n = 0;
+    uint8_t *data = (uint8_t *)s;
+
+    while((c = *s++) && c != '=' && c != input.eol) {
+        if((v = base64_value(c)) < 0)
+            return 0;
+        acc = (acc << 6) | v;
+        if((bits += 6) >= 8) {
+            bits -= 8;
+            data[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+
+    return n;
+}
+
+static inline char *get_s_binary (uint8_t value, uint_fast16_t *length)
+{
+#if LB_SVALUE_SCALING
+    return s_value_str(get_s_binary_scaled(value), length);
+#else
+    return s_value_str(value, length);
+#endif
+}
+
+#endif
+
+static inline void output_reset (void)
+{
+    output.length = output.idx = output.n = 0;
+}
+
+static inline int16_t output_read (void)
+{
+    while(output.length == 0) {
+        if(output.idx == output.n)
+            return SERIAL_NO_DATA;
+        output.s = output.slice[output.idx].s;
+        output.length = output.slice[output.idx++].length;
+    }
+
+    output.length--;
+
+    return (int16_t)*output.s++;
+}
+
+// Output the line in input.block as is.
+static inline void output_line (void)
+{
+    output.s = input.s;
+    output.length = input.length;
+    output.idx = output.n = 0;
+}
+
+// Pass an empty line to the parser and report the error in place of its "ok".
+static void cluster_reject (status_code_t status)
+{
+    cluster.status = status;
+    cluster.count = 0;
+    input.s = &input.eol;
+    input.length = 1;
+}
+
+// Parse a LightBurn cluster line in input.block, returns true if the line is a cluster.
+// ASCII S value positions are recorded for later output, binary S values are decoded in place.
+static bool cluster_parse (void)
+{
+    char c, *s, *s2, *s3, *end = cluster.cmd + sizeof(cluster.cmd) - 1;
+    uint_fast8_t params = 0;
     float val;
-    uint_fast8_t cc = 0;
 
-    read_float(v, &cc, &val);
+    cluster.count = cluster.next = 0;
 
-    s = ftoa(val * settings.spindle.rpm_max, 0);
+#if LB_CLUSTERS_BINARY
+    cluster.data = NULL;
 
-    *strchr(s, '.') = input.eol;
+    if(!(input.length > 5 && !strncasecmp(input.s, "G1", 2)))
+        return false;
+#else
+    if(!(input.length > 5 && !strncasecmp(input.s, "G1", 2) && strchr(input.s, ':')))
+        return false;
+#endif
 
-    return s;
+    s = cluster.cmd;
+    s2 = input.s;
+
+    while((c = *s2++)) {
+        if(c != ' ') {
+            if(s == end)
+                return false;
+            *s++ = c;
+        }
+        if(c == 'S')
+            break;
+    }
+    *s = '\0';
+
+    if(c != 'S')
+        return false;
+
+#if LB_CLUSTERS_BINARY
+    // '@' is not valid in a G-code word value, unlike '#' which starts a parameter reference.
+    if(*s2 == '@') {
+        if((cluster.count = base64_decode(s2 + 1)) == 0) {
+            cluster_reject(Status_InvalidStatement);
+            return false;
+        }
+        cluster.data = (uint8_t *)(s2 + 1);
+    } else if(!strchr(s2, ':'))
+        return false;
+    else
+#endif
+    for(s3 = s2;; s2++) {
+        c = *s2;
+        if(c == ':' || c == '\0' || c == input.eol) {
+            if(cluster.count == cluster.size) {
+                cluster.count = 0; // Too many elements, pass line to the parser for it to report an error.
+                return false;
+            }
+            cluster.sval_offset[cluster.count] = (uint16_t)(s3 - input.block);
+            cluster.sval_length[cluster.count++] = (uint8_t)(s2 - s3);
+            if(c != ':')
+                break;
+            s3 = s2 + 1;
+        }
+    }
+
+    s = cluster.cmd + 3;
+    if(!read_float(s, &params, &val)) {
+        cluster.count = 0;
+        return false;
+    }
+
+    // Words between the distance and the S value are output with the first element only, the line is not executed if they do not fit.
+    if((cluster.param_length = (uint_fast8_t)(strchr(s, '\0') - (s + params) - 1)) >= sizeof(cluster.param)) {
+        cluster_reject(Status_Overflow);
+        return false;
+    }
+    memcpy(cluster.param, s + params, cluster.param_length);
+
+    strcpy(s, ftoa(val / (float)cluster.count, 8));
+    s = strchr(s, '\0');
+    while(*(s - 1) == '0')
+        s--;
+    *s++ = 'S';
+    *s = '\0';
+
+    cluster.cmd_length = s - cluster.cmd;
+
+#if LB_CLUSTERS_DIRECT
+    // The previous line has been executed when the next is read, the parser position is the cluster start.
+    memcpy(cluster.start, gc_state.position, sizeof(cluster.start));
+#endif
+
+    return true;
 }
 
+// Set up output slices for the next cluster element.
+static void cluster_next (void)
+{
+    uint_fast8_t n = 0;
+
+    output.slice[n].s = cluster.cmd;
+    output.slice[n++].length = cluster.cmd_length;
+
+#if LB_CLUSTERS_BINARY
+    if(cluster.data)
+        output.slice[n].s = get_s_binary(cluster.data[cluster.next], &output.slice[n].length);
+    else
+#endif
+#if LB_SVALUE_SCALING
+    output.slice[n].s = get_s_value(input.block + cluster.sval_offset[cluster.next], &output.slice[n].length);
+#else
+    {
+        output.slice[n].s = input.block + cluster.sval_offset[cluster.next];
+        output.slice[n].length = cluster.sval_length[cluster.next];
+    }
 #endif
+    n++;
+
+    if(cluster.next == 0 && cluster.param_length) {
+        output.slice[n].s = cluster.param;
+        output.slice[n++].length = cluster.param_length;
+    }
+
+    output.slice[n].s = &input.eol;
+    output.slice[n++].length = 1;
+
+    output.s = output.slice[0].s;
+    output.length = output.slice[0].length;
+    output.idx = 1;
+    output.n = n;
+
+//  if(cluster.next == 1) !! oddly this slows down the parser
+//      output.s += 2, output.length -= 2;
+    if(++cluster.next == cluster.count)
+        cluster.count = 0;
+}
 
 // File stream decoder
 
@@ -123,96 +483,23 @@ static inline void file_fill_buffer (void)
 
         *s = '\0';
 
-        if(input.length > 5 && !strncasecmp(input.block, "G1", 2) && strchr(input.block, ':')) {
-
-            char *s2 = input.block, *s3;
-            uint_fast8_t params = 0;
-
-            s = cluster.block;
-
-            while((c = *s2++)) {
-                if(c != ' ')
-                    *s++ = c;
-                if(c == 'S')
-                    break;
-            }
-            *s = '\0';
-
-            cluster.s = s;
-            cluster.cmd = cluster.block;
-            cluster.count = cluster.next = 0;
-
-            s3 = s2;
-            while((c = *s2)) {
-                if(c == ':') {
-#if LB_SVALUE_SCALING
-                    *s2++ = '\0';
-                    strcpy(cluster.sval[cluster.count++], get_s_value(s3));
-#else
-                    *s2++ = input.eol;
-                    c = *s2;
-                    *s2 = '\0';
-                    strcpy(cluster.sval[cluster.count++], s3);
-                    *s2 = (char)c;
-#endif
-                    if(cluster.count == LB_CLUSTER_SIZE) {
-                        cluster.count = input.length = 0;
-                        return;
-                    }
-                    s3 = s2;
-                }
-                s2++;
-            }
-#if LB_SVALUE_SCALING
-            strcpy(cluster.sval[cluster.count++], get_s_value(s3));
-#else
-            *s2 = '\0';
-            strcpy(cluster.sval[cluster.count++], s3);
-#endif
-            s = cluster.cmd + 3;
-            s2 = get_value(s, &params, cluster.count);
-            if(strchr(s, '\0') != s + params + 1) {
-                strcpy(cluster.param, s + params);
-                *strchr(cluster.param, 'S') = input.eol;
-                *strchr(cluster.sval[0], input.eol) = '\0';
-            }
-            else
-                *cluster.param = '\0';
-            strcpy(s, s2);
-            cluster.s = strchr(s, '\0');
-            while(*(cluster.s - 1) == '0')
-                *(--cluster.s) = '\0';
-            strcat(cluster.s++, "S");
+        if(!cluster_parse()) {
+            output_line();
+            return;
         }
     }
 
-    if(cluster.count) {
-        strcpy(cluster.s, cluster.sval[cluster.next++]);
-        if(*cluster.param) {
-            strcat(cluster.s, cluster.param);
-            *cluster.param = '\0';
-        }
-//        if(cluster.next == 2) !! oddly this slows down the parser
-//            cluster.cmd += 2;
-        if(cluster.next == cluster.count)
-            cluster.count = 0;
-        input.s = cluster.cmd;
-        input.length = strlen(cluster.cmd);
-    }
+    cluster_next();
 }
 
 static int16_t file_decoder (void)
 {
     int16_t c;
 
-    if(input.length == 0)
+    if((c = output_read()) == SERIAL_NO_DATA) {
         file_fill_buffer();
-
-    if(input.length) {
-        c = *input.s++;
-        input.length--;
-    } else
-        c = SERIAL_NO_DATA;
+        c = output_read();
+    }
 
     return c;
 }
@@ -225,126 +512,58 @@ static int16_t stream_fill_buffer (void)
 
     int16_t c;
 
-    if(s == NULL || input.s == NULL) {
-        input.s = s = input.block;
-        cluster.count = input.length = 0;
-    }
-
     if(cluster.count == 0) {
 
-        c = stream_read();
-
-        if(c == SERIAL_NO_DATA || c == ASCII_CAN) {
-
-            if(ABORTED) {
-                cluster.count = input.length = 0;
-                s = NULL;
-            }
-
-            return c;
-        }
-
-        if(++input.length >= LINE_BUFFER_SIZE - 1) {
-            s = NULL;
-            return SERIAL_NO_DATA;
+        if(s == NULL || input.s == NULL) {
+            input.s = s = input.block;
+            input.length = 0;
         }
 
-        *s++ = (char)c;
-
-        if((char)c == '\n' || (char)c == '\r') {
-            if(input.length == 1 && input.eol && input.eol != (char)c) {
-                input.eol = '\0';
-                input.length = 0;
-                s--;
-                return SERIAL_NO_DATA;
-            }
-            input.eol = (char)c;
-        } else
-            return SERIAL_NO_DATA;
+        // Drain the available characters up to the end of the line in one call.
+        while(true) {
 
-        *s = '\0';
+            c = stream_read();
 
-        if(input.length > 5 && !strncasecmp(input.block, "G1", 2) && strchr(input.block, ':')) {
+            if(c == SERIAL_NO_DATA || c == ASCII_CAN) {
 
-            char *s2 = input.block, *s3;
-            uint_fast8_t params = 0;
+                if(ABORTED) {
+                    cluster.count = input.length = 0;
+                    s = NULL;
+                }
 
-            s = cluster.block;
+                return c;
+            }
 
-            while((c = *s2++)) {
-                if(c != ' ')
-                    *s++ = c;
-                if(c == 'S')
-                    break;
+            if(++input.length >= LINE_BUFFER_SIZE - 1) {
+                s = NULL;
+                return SERIAL_NO_DATA;
             }
-            *s = '\0';
 
-            cluster.s = s;
-            cluster.cmd = cluster.block;
-            strcpy(cluster.param, cluster.block);
-            cluster.count = cluster.next = 0;
+            *s++ = (char)c;
 
-            s3 = s2;
-            while((c = *s2)) {
-                if(c == ':') {
-#if LB_SVALUE_SCALING
-                    *s2++ = '\0';
-                    strcpy(cluster.sval[cluster.count++], get_s_value(s3));
-#else
-                    *s2++ = input.eol;
-                    c = *s2;
-                    *s2 = '\0';
-                    strcpy(cluster.sval[cluster.count++], s3);
-                    *s2 = (char)c;
-#endif
-                    if(cluster.count == LB_CLUSTER_SIZE) {
-                        s = NULL;
-                        return SERIAL_NO_DATA;
-                    }
-                    s3 = s2;
+            if((char)c == '\n' || (char)c == '\r') {
+                if(input.length == 1 && input.eol && input.eol != (char)c) {
+                    input.eol = '\0';
+                    input.length = 0;
+                    s--;
+                    continue;
                 }
-                s2++;
-            }
-#if LB_SVALUE_SCALING
-            strcpy(cluster.sval[cluster.count++], get_s_value(s3));
-#else
-            *s2 = '\0';
-            strcpy(cluster.sval[cluster.count++], s3);
-#endif
-            s = cluster.cmd + 3;
-            s2 = get_value(s, &params, cluster.count);
-            if(strchr(s, '\0') != s + params + 1) {
-                strcpy(cluster.param, s + params);
-                *strchr(cluster.param, 'S') = input.eol;
-                *strchr(cluster.sval[0], input.eol) = '\0';
+                input.eol = (char)c;
+                break;
             }
-            else
-                *cluster.param = '\0';
-            strcpy(s, s2);
-            cluster.s = strchr(s, '\0');
-            while(*(cluster.s - 1) == '0')
-                *(--cluster.s) = '\0';
-            strcat(cluster.s++, "S");
-        } else
-            s = NULL;
-    }
-
-    if(cluster.count) {
-        strcpy(cluster.s, cluster.sval[cluster.next++]);
-        if(*cluster.param) {
-            strcat(cluster.s, cluster.param);
-            *cluster.param = '\0';
         }
-//        if(cluster.next == 2) !! oddly this slows down the parser
-//            cluster.cmd += 2;
-        if(cluster.next == cluster.count) {
-            s = NULL;
-            cluster.count = 0;
+
+        *s = '\0';
+        s = NULL;
+
+        if(!cluster_parse()) {
+            output_line();
+            return 0;
         }
-        input.s = cluster.cmd;
-        input.length = strlen(cluster.cmd);
     }
 
+    cluster_next();
+
     return 0;
 }
 
@@ -354,38 +573,159 @@ static int16_t stream_decoder (void)
 
     int16_t c;
 
-    if(buffering) {
-        while((c = stream_fill_buffer()) != 0) {
-            if(ABORTED)
-                break;
+    // The next line is buffered as soon as the previous has been read, without an extra round trip.
+    if(!buffering) {
+        if((c = output_read()) != SERIAL_NO_DATA)
             return c;
-        }
-        buffering = false;
+        buffering = true;
     }
 
-    if(input.length) {
-        c = *input.s++;
-        input.length--;
-    } else {
+    if((c = stream_fill_buffer()) != 0 && !ABORTED)
+        return c;
+
+    buffering = false;
+
+    if((c = output_read()) == SERIAL_NO_DATA)
         buffering = true;
-        c = SERIAL_NO_DATA;
-    }
 
     return c;
 }
 
+#if LB_CLUSTERS_DIRECT
+
+static float cluster_s_value (uint_fast16_t idx)
+{
+#if LB_CLUSTERS_BINARY
+    if(cluster.data)
+  #if LB_SVALUE_SCALING
+        return (float)get_s_binary_scaled(cluster.data[idx]);
+  #else
+        return (float)cluster.data[idx];
+  #endif
+#endif
+
+#if LB_SVALUE_SCALING
+    return (float)get_s_scaled(input.block + cluster.sval_offset[idx]);
+#else
+    float val;
+    uint_fast8_t cc = 0;
+
+    read_float(input.block + cluster.sval_offset[idx], &cc, &val);
+
+    return val;
+#endif
+}
+
+#if LB_CLUSTERS_RASTER
+
+static float raster_s_value (uint_fast16_t idx)
+{
+    return cluster_s_value(cluster.next + idx);
+}
+
+#endif
+
+// Elements following the first are only equal length moves with a new S value when
+// in laser mode, using incremental distance and units per minute feed rate.
+static inline bool cluster_direct_ok (void)
+{
+    return settings.mode == Mode_Laser &&
+            gc_state.modal.motion == MotionMode_Linear &&
+             gc_state.modal.distance_incremental &&
+              gc_state.modal.feed_mode == FeedMode_UnitsPerMin &&
+               state_get() != STATE_CHECK_MODE;
+}
+
+// The first element has been validated and executed by the parser, the motion it
+// added to the parser position is repeated for the remaining elements.
+static void cluster_direct (void)
+{
+    uint_fast8_t idx;
+    float delta[N_AXIS], target[N_AXIS];
+    plan_line_data_t plan_data;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        target[idx] = gc_state.position[idx];
+        delta[idx] = target[idx] - cluster.start[idx];
+    }
+
+    plan_data_init(&plan_data);
+    plan_data.feed_rate = gc_state.feed_rate;
+    plan_data.spindle.hal = gc_state.spindle.hal;
+    plan_data.condition.spindle = gc_state.modal.spindle;
+    plan_data.condition.coolant = gc_state.modal.coolant;
+    plan_data.condition.is_rpm_rate_adjusted = gc_state.is_rpm_rate_adjusted;
+    plan_data.condition.is_laser_ppi_mode = gc_state.is_rpm_rate_adjusted && gc_state.is_laser_ppi_mode;
+    plan_data.overrides = gc_state.modal.override_ctrl;
+    plan_data.line_number = gc_state.line_number;
+
+#if LB_CLUSTERS_RASTER
+    // The remaining elements are sent as a single motion with the S values output by the laser plugin
+    // at equally spaced positions. The motion is tagged with the spindle handlers returned by the plugin.
+    // If the raster buffer is full they are sent as separate motions.
+    uint_fast16_t n_pixels = cluster.count - cluster.next;
+    spindle_ptrs_t *raster_spindle;
+
+    if(n_pixels > 1 && (raster_spindle = laser_raster_enqueue(gc_state.spindle.hal, n_pixels, raster_s_value))) {
+
+        for(idx = 0; idx < N_AXIS; idx++)
+            target[idx] += delta[idx] * (float)n_pixels;
+
+        plan_data.spindle.hal = raster_spindle;
+        plan_data.spindle.rpm = cluster_s_value(cluster.next);
+
+        if(mc_line(target, &plan_data)) {
+            memcpy(gc_state.position, target, sizeof(target));
+            gc_state.spindle.rpm = cluster_s_value(cluster.count - 1);
+        }
+
+        cluster.next = cluster.count;
+    } else
+#endif
+    do {
+        for(idx = 0; idx < N_AXIS; idx++)
+            target[idx] += delta[idx];
+
+        plan_data.spindle.rpm = cluster_s_value(cluster.next);
+
+        if(!mc_line(target, &plan_data))
+            break;
+
+        memcpy(gc_state.position, target, sizeof(target));
+        gc_state.spindle.rpm = plan_data.spindle.rpm;
+    } while(++cluster.next < cluster.count);
+
+    cluster.count = 0;
+    output_reset();
+}
+
+#endif
+
 // Only respond with a single "ok" message for each cluster
 // or terminate cluster unpacking if error status reported.
 static status_code_t cluster_status_message (status_code_t status_code)
 {
+    if(cluster.status != Status_OK) {
+        if(status_code == Status_OK)
+            status_code = cluster.status;
+        cluster.status = Status_OK;
+    }
+
     if(status_code != Status_OK) {
         status_message(status_code);
         if(cluster.next) {
             input.s = NULL;
             cluster.count = cluster.next = input.length = 0;
+            output_reset();
         }
-    } else if(cluster.count == 0)
-        status_message(status_code);
+    } else {
+#if LB_CLUSTERS_DIRECT
+        if(cluster.count && cluster.next == 1 && cluster_direct_ok())
+            cluster_direct();
+#endif
+        if(cluster.count == 0)
+            status_message(status_code);
+    }
 
     return status_code;
 }
@@ -404,6 +744,8 @@ static void stream_changed (stream_type_t type)
     }
 
     cluster.count = cluster.next = input.length = 0;
+    cluster.status = Status_OK;
+    output_reset();
 }
 
 static void cluster_reset (void)
@@ -412,6 +754,8 @@ static void cluster_reset (void)
         on_reset();
 
     cluster.count = cluster.next = input.length = 0;
+    cluster.status = Status_OK;
+    output_reset();
 }
 
 static void cluster_report (void)
@@ -423,13 +767,69 @@ static void cluster_report (void)
     grbl.report.status_message = cluster_status_message;
 }
 
+static const setting_detail_t lb_clusters_settings[] = {
+    { LB_CLUSTER_SIZE_SETTING, Group_General, "LightBurn cluster size", NULL, Format_Int8, "##0", "0", "255", Setting_NonCore, &lb_settings.cluster_size, NULL, NULL, { .reboot_required = On } }
+};
+
+#ifndef NO_SETTINGS_DESCRIPTIONS
+
+static const setting_descr_t lb_clusters_settings_descr[] = {
+    { LB_CLUSTER_SIZE_SETTING, "Maximum number of S values in a LightBurn cluster, values below the compiled in default are ignored.\\n"
+                               "Memory for the cluster is allocated at startup." },
+};
+
+#endif
+
+static void lb_clusters_settings_save (void)
+{
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&lb_settings, sizeof(lb_clusters_settings_t), true);
+}
+
+static void lb_clusters_settings_restore (void)
+{
+    lb_settings.cluster_size = LB_CLUSTER_SIZE;
+
+    lb_clusters_settings_save();
+}
+
+// Allocates cluster storage once, a changed capacity requires a reboot.
+static void lb_clusters_settings_load (void)
+{
+    static bool allocated = false;
+
+    uint8_t *arena;
+
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&lb_settings, nvs_address, sizeof(lb_clusters_settings_t), true) != NVS_TransferResult_OK)
+        lb_clusters_settings_restore();
+
+    if(!allocated && lb_settings.cluster_size > LB_CLUSTER_SIZE &&
+        (arena = malloc(lb_settings.cluster_size * (sizeof(uint16_t) + sizeof(uint8_t))))) {
+        allocated = true;
+        cluster.size = lb_settings.cluster_size;
+        cluster.sval_offset = (uint16_t *)arena;
+        cluster.sval_length = arena + cluster.size * sizeof(uint16_t);
+    }
+}
+
+static setting_details_t setting_details = {
+    .settings = lb_clusters_settings,
+    .n_settings = sizeof(lb_clusters_settings) / sizeof(setting_detail_t),
+#ifndef NO_SETTINGS_DESCRIPTIONS
+    .descriptions = lb_clusters_settings_descr,
+    .n_descriptions = sizeof(lb_clusters_settings_descr) / sizeof(setting_descr_t),
+#endif
+    .save = lb_clusters_settings_save,
+    .load = lb_clusters_settings_load,
+    .restore = lb_clusters_settings_restore
+};
+
 static void report_options (bool newopt)
 {
     if(!newopt) {
         hal.stream.write("[CLUSTER:");
-        hal.stream.write(uitoa(LB_CLUSTER_SIZE));
+        hal.stream.write(uitoa(cluster.size));
         hal.stream.write("]" ASCII_EOL);
-        hal.stream.write("[PLUGIN:LightBurn clusters v0.06]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:LightBurn clusters v0.09]" ASCII_EOL);
     }
 
     on_report_options(newopt);
@@ -437,6 +837,20 @@ static void report_options (bool newopt)
 
 void lb_clusters_init (void)
 {
+    cluster.size = LB_CLUSTER_SIZE;
+    cluster.sval_offset = sval_offset;
+    cluster.sval_length = sval_length;
+
+    if((nvs_address = nvs_alloc(sizeof(lb_clusters_settings_t))))
+        settings_register(&setting_details);
+
+#if LB_SVALUE_SCALING
+    s_scale_update();
+
+    settings_changed = hal.settings_changed;
+    hal.settings_changed = onSettingsChanged;
+#endif
+
     on_stream_changed = grbl.on_stream_changed;
     grbl.on_stream_changed = stream_changed;
 
@@ -30,53 +30,192 @@
 
 #include "grbl/hal.h"
 
+#ifndef LASER_PPI_REPORT_MCODE
+#define LASER_PPI_REPORT_MCODE 129
+#endif
+
+#define LaserPPI_Report ((user_mcode_t)LASER_PPI_REPORT_MCODE)
+
+// Distances are in fixed point, 2^-16 um units, to keep floating point out of the step interrupt.
+#define PPI_DISTANCE_SCALE (65536.0f * 1000.0f)
+
+typedef enum {
+    PPIMode_Off = 0,
+    PPIMode_Step,   // Pulses fired from the step interrupt.
+    PPIMode_Timer   // Pulse train from a timer, period updated per segment.
+} ppi_mode_t;
+
 typedef struct {
     uint_fast16_t ppi;
-    float ppi_distance;
-    float ppi_pos;
-    float next_pos;
+    int32_t ppi_distance;       // Distance between pulses.
+    volatile int32_t next_pulse; // Distance left to next pulse.
     uint_fast16_t pulse_length; // uS
+    ppi_mode_t mode;
+    volatile uint32_t period;   // uS, timer mode, loaded into the timer on its next expiry.
+    uint32_t timer_period;      // uS, timer mode, period the timer is running with.
+    void *segment;              // Segment the period was last calculated for, timer mode.
     bool on;
 } laser_ppi_t;
 
 static laser_ppi_t laser = {
-    .ppi = 600.0f,
-    .ppi_distance = 25.4f / 600.0f,
+    .ppi = 600,
+    .ppi_distance = (int32_t)(25.4f / 600.0f * PPI_DISTANCE_SCALE),
     .pulse_length = 1500,
+    .mode = PPIMode_Off,
     .on = false
 };
 
+typedef struct {
+    volatile uint32_t pulses;
+    volatile uint32_t missed;           // Pulses started while the previous was still active.
+    volatile uint32_t cycles;           // Step timer cycles since last pulse, step mode only.
+    volatile uint32_t block_pulses;
+    volatile uint32_t block_steps;
+    volatile uint32_t last_pulses;      // Pulses and dominant axis steps in last completed block
+    volatile uint32_t last_steps;       // with laser on, for calculating effective PPI.
+    volatile int32_t last_step_distance;
+} ppi_stats_t;
+
+static ppi_stats_t stats = { .cycles = 0x80000000 };
+static hal_timer_t ppi_timer = NULL;
+static uint32_t step_cycles_per_us;
 static user_mcode_ptrs_t user_mcode;
 static on_report_options_ptr on_report_options;
+static on_realtime_report_ptr on_realtime_report;
 static void (*stepper_wake_up)(void);
+static void (*stepper_go_idle)(bool clear_signals);
 static void (*stepper_pulse_start)(stepper_t *stepper);
 static spindle_pulse_on_ptr pulse_on;
 static on_spindle_selected_ptr on_spindle_selected;
 static spindle_update_pwm_ptr spindle_update_pwm;
 static spindle_update_rpm_ptr spindle_update_rpm;
 
+static inline void ppi_pulse (bool missed)
+{
+    stats.pulses++;
+    stats.block_pulses++;
+    if(missed)
+        stats.missed++;
+
+    pulse_on(laser.pulse_length);
+}
+
+// A changed period is loaded on expiry so that the time elapsed towards the current pulse is not lost,
+// restarting the timer from the step interrupt would stretch or drop pulses at each segment.
+static void ppi_timer_irq (void *context)
+{
+    if(laser.on)
+        ppi_pulse(laser.timer_period < laser.pulse_length);
+
+    if(laser.period && laser.period != laser.timer_period)
+        hal.timer.start(ppi_timer, laser.timer_period = laser.period);
+}
+
+// Start the pulse train with a pulse or stop it, timer mode only.
+static void ppi_timer_enable (bool on)
+{
+    if(on && laser.period) {
+        ppi_pulse(false);
+        hal.timer.start(ppi_timer, laser.timer_period = laser.period);
+    } else
+        hal.timer.stop(ppi_timer);
+}
+
 static void stepperWakeUp (void)
 {
-    laser.ppi_pos = laser.next_pos = 0.0f;
+    laser.next_pulse = 0;
+    laser.period = 0;
+    laser.segment = NULL;
 
     stepper_wake_up();
 }
 
+static void stepperGoIdle (bool clear_signals)
+{
+    if(laser.mode == PPIMode_Timer)
+        hal.timer.stop(ppi_timer);
+
+    stepper_go_idle(clear_signals);
+}
+
+// steps_per_mm of a block is step events per mm along the path, where a step event is a step of the
+// dominant axis. Only counting ticks where the dominant axis steps makes pulse spacing follow the
+// true path length, other axes may step on other ticks when AMASS is active.
+// In timer mode the pulse period is recalculated from the step rate on each new segment instead, and
+// loaded by the timer interrupt at the end of the pulse interval in progress.
 static void stepperPulseStartPPI (stepper_t *stepper)
 {
-    static float mm_per_step;
+    static uint32_t steps_per_mm = 0, dominant_axis = 0;
+    static uint64_t steps_per_pulse = 0; // Q16
+    static int32_t step_distance = 0, ppi_distance = 0;
 
-    if(laser.on) {
+    if(stepper->new_block) {
 
-        if(stepper->new_block)
-            mm_per_step = 1.0f / stepper->exec_block->steps_per_mm;
+        uint_fast8_t idx = N_AXIS;
+        uint32_t block_steps_per_mm;
+
+        if(stats.block_steps) {
+            stats.last_pulses = stats.block_pulses;
+            stats.last_steps = stats.block_steps;
+            stats.last_step_distance = step_distance;
+        }
+        stats.block_pulses = stats.block_steps = 0;
 
-        if(stepper->step_outbits.mask) {
-            laser.ppi_pos += mm_per_step;
-            if(laser.ppi_pos >= laser.next_pos) {
-                laser.next_pos += laser.ppi_distance;
-                pulse_on(laser.pulse_length);
+        // Segment buffer slots are reused, force the period to be recalculated for the new block.
+        laser.segment = NULL;
+
+        do {
+            if(stepper->exec_block->steps[--idx] == stepper->exec_block->step_event_count) {
+                dominant_axis = 1 << idx;
+                break;
             }
+        } while(idx);
+
+        // Distance per step is only recalculated when steps/mm changes, compared as raw bits to avoid float math.
+        memcpy(&block_steps_per_mm, &stepper->exec_block->steps_per_mm, sizeof(uint32_t));
+        if(block_steps_per_mm != steps_per_mm) {
+            steps_per_mm = block_steps_per_mm;
+            step_distance = (int32_t)(PPI_DISTANCE_SCALE / stepper->exec_block->steps_per_mm);
+            ppi_distance = 0;
+        }
+    }
+
+    if(laser.on && (stepper->step_outbits.mask & dominant_axis))
+        stats.block_steps++;
+
+    if(laser.mode == PPIMode_Timer) {
+
+        if(stepper->exec_segment != laser.segment) {
+
+            uint32_t period;
+
+            laser.segment = stepper->exec_segment;
+
+            if(ppi_distance != laser.ppi_distance) {
+                ppi_distance = laser.ppi_distance;
+                steps_per_pulse = ((uint64_t)ppi_distance << 16) / (uint32_t)step_distance;
+            }
+
+            if((period = (uint32_t)(((steps_per_pulse * stepper->exec_segment->cycles_per_tick) << stepper->amass_level) >> 16) / step_cycles_per_us) == 0)
+                period = 1;
+
+            if(period != laser.period) {
+                bool start = laser.period == 0;
+                laser.period = period;
+                if(start && laser.on)
+                    ppi_timer_enable(true);
+            }
+        }
+
+    } else if(laser.on) {
+
+        if(stats.cycles < 0x80000000)
+            stats.cycles += stepper->exec_segment->cycles_per_tick;
+
+        if((stepper->step_outbits.mask & dominant_axis) && (laser.next_pulse -= step_distance) <= 0) {
+            laser.next_pulse += laser.ppi_distance;
+            ppi_pulse(stats.cycles < laser.pulse_length * step_cycles_per_us);
+            stats.cycles = 0;
         }
     }
 
@@ -85,49 +224,103 @@ static void stepperPulseStartPPI (stepper_t *stepper)
 
 static void ppiUpdatePWM (uint_fast16_t pwm)
 {
-    if(!laser.on && pwm > 0)
-        laser.ppi_pos = laser.next_pos = 0.0f;
+    bool on = pwm > 0;
 
-    laser.on = pwm > 0;
+    if(!laser.on && on) {
+        laser.next_pulse = 0;
+        stats.cycles = 0x80000000;
+    }
+
+    if(laser.mode == PPIMode_Timer && laser.on != on)
+        ppi_timer_enable(on);
+
+    laser.on = on;
 
     spindle_update_pwm(pwm);
 }
 
 static void ppiUpdateRPM (float rpm)
 {
-    if(!laser.on && rpm > 0.0f)
-        laser.ppi_pos = laser.next_pos = 0.0f;
+    bool on = rpm > 0.0f;
+
+    if(!laser.on && on) {
+        laser.next_pulse = 0;
+        stats.cycles = 0x80000000;
+    }
 
-    laser.on = rpm > 0.0f;
+    if(laser.mode == PPIMode_Timer && laser.on != on)
+        ppi_timer_enable(on);
+
+    laser.on = on;
 
     spindle_update_rpm(rpm);
 }
 
-static bool enable_ppi (bool on)
+static ppi_mode_t enable_ppi (ppi_mode_t mode)
 {
-    if(!gc_laser_ppi_enable(on ? laser.ppi : 0, laser.pulse_length)) {
+    if(laser.mode == PPIMode_Timer && mode != PPIMode_Timer)
+        hal.timer.stop(ppi_timer);
+
+    if(!gc_laser_ppi_enable(mode != PPIMode_Off ? laser.ppi : 0, laser.pulse_length)) {
 
-        if(on && stepper_wake_up == NULL) {
+        if(mode != PPIMode_Off && stepper_wake_up == NULL) {
             stepper_wake_up = hal.stepper.wake_up;
             hal.stepper.wake_up = stepperWakeUp;
+            stepper_go_idle = hal.stepper.go_idle;
+            hal.stepper.go_idle = stepperGoIdle;
             stepper_pulse_start = hal.stepper.pulse_start;
             hal.stepper.pulse_start = stepperPulseStartPPI;
         }
 
-        if(!on && stepper_wake_up != NULL) {
+        if(mode == PPIMode_Off && stepper_wake_up != NULL) {
             hal.stepper.wake_up = stepper_wake_up;
             stepper_wake_up = NULL;
+            hal.stepper.go_idle = stepper_go_idle;
+            stepper_go_idle = NULL;
             hal.stepper.pulse_start = stepper_pulse_start;
             stepper_pulse_start = NULL;
         }
     }
 
-    return on;
+    laser.period = 0;
+    laser.segment = NULL;
+
+    return laser.mode = mode;
+}
+
+// Outputs pulses emitted, pulses missed and effective PPI of the last block with laser on.
+static void report_stats (stream_write_ptr stream_write, bool message)
+{
+    uint32_t steps = stats.last_steps;
+    float ppi = steps ? (float)stats.last_pulses * 25.4f * PPI_DISTANCE_SCALE / ((float)steps * (float)stats.last_step_distance) : 0.0f;
+
+    stream_write(message ? "[PPI:" : "|PPI:");
+    stream_write(uitoa(stats.pulses));
+    stream_write(",");
+    stream_write(uitoa(stats.missed));
+    stream_write(",");
+    stream_write(uitoa((uint32_t)(ppi + 0.5f)));
+    if(message)
+        stream_write("]");
+}
+
+static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    static uint32_t pulses = 0, missed = 0;
+
+    if(laser.mode != PPIMode_Off && (report.all || pulses != stats.pulses || missed != stats.missed)) {
+        pulses = stats.pulses;
+        missed = stats.missed;
+        report_stats(stream_write, false);
+    }
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
 }
 
 static user_mcode_t userMCodeCheck (user_mcode_t mcode)
 {
-    return mcode == LaserPPI_Enable || mcode == LaserPPI_Rate || mcode == LaserPPI_PulseLength
+    return mcode == LaserPPI_Enable || mcode == LaserPPI_Rate || mcode == LaserPPI_PulseLength || mcode == LaserPPI_Report
             ? mcode
             : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Ignore);
 }
@@ -142,7 +335,10 @@ static status_code_t userMCodeValidate (parser_block_t *gc_block, parameter_word
             if(!hal.driver_cap.laser_ppi_mode)
                 state = Status_GcodeUnsupportedCommand;
             else if(gc_block->words.p) {
-                state = isnan(gc_block->values.p) ? Status_BadNumberFormat : Status_OK;
+                if(isnan(gc_block->values.p))
+                    state = Status_BadNumberFormat;
+                else
+                    state = gc_block->values.p == (float)PPIMode_Timer && ppi_timer == NULL ? Status_GcodeValueOutOfRange : Status_OK;
                 gc_block->words.p = Off;
             }
             break;
@@ -167,6 +363,16 @@ static status_code_t userMCodeValidate (parser_block_t *gc_block, parameter_word
             }
             break;
 
+        case LaserPPI_Report:
+            if(!hal.driver_cap.laser_ppi_mode)
+                state = Status_GcodeUnsupportedCommand;
+            else if(gc_block->words.p) {
+                state = isnan(gc_block->values.p) ? Status_BadNumberFormat : Status_OK;
+                gc_block->words.p = Off;
+            } else
+                state = Status_OK;
+            break;
+
         default:
             state = Status_Unhandled;
             break;
@@ -177,7 +383,7 @@ static status_code_t userMCodeValidate (parser_block_t *gc_block, parameter_word
 
 static void userMCodeExecute (uint_fast16_t state, parser_block_t *gc_block)
 {
-    static bool ppi_on = false;
+    static ppi_mode_t ppi_mode = PPIMode_Off;
 
     bool handled = true;
 
@@ -185,19 +391,27 @@ static void userMCodeExecute (uint_fast16_t state, parser_block_t *gc_block)
       switch(gc_block->user_mcode) {
 
         case LaserPPI_Enable:
-            ppi_on = gc_block->values.p != 0.0f;
-            enable_ppi(ppi_on && laser.ppi > 0 && laser.pulse_length > 0);
+            stats.pulses = stats.missed = stats.last_steps = 0;
+            ppi_mode = gc_block->values.p == 0.0f ? PPIMode_Off : (gc_block->values.p == (float)PPIMode_Timer ? PPIMode_Timer : PPIMode_Step);
+            enable_ppi(laser.ppi > 0 && laser.pulse_length > 0 ? ppi_mode : PPIMode_Off);
             break;
 
         case LaserPPI_Rate:
             if((laser.ppi = (uint_fast16_t)gc_block->values.p) != 0)
-                laser.ppi_distance = 25.4f / (float)laser.ppi;
-            enable_ppi(ppi_on && laser.ppi > 0 && laser.pulse_length > 0);
+                laser.ppi_distance = (int32_t)(25.4f / (float)laser.ppi * PPI_DISTANCE_SCALE);
+            enable_ppi(laser.ppi > 0 && laser.pulse_length > 0 ? ppi_mode : PPIMode_Off);
             break;
 
         case LaserPPI_PulseLength:
             laser.pulse_length = (uint16_t)gc_block->values.p;
-            enable_ppi(ppi_on && laser.ppi > 0 && laser.pulse_length > 0);
+            enable_ppi(laser.ppi > 0 && laser.pulse_length > 0 ? ppi_mode : PPIMode_Off);
+            break;
+
+        case LaserPPI_Report:
+            report_stats(hal.stream.write, true);
+            hal.stream.write(ASCII_EOL);
+            if(gc_block->values.p != 0.0f)
+                stats.pulses = stats.missed = stats.last_steps = 0;
             break;
 
         default:
@@ -235,13 +449,24 @@ static void onReportOptions (bool newopt)
     on_report_options(newopt);
 
     if(!newopt)
-        hal.stream.write("[PLUGIN:Laser PPI v0.05]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:Laser PPI v0.09]" ASCII_EOL);
 }
 
 void ppi_init (void)
 {
     memcpy(&user_mcode, &hal.user_mcode, sizeof(user_mcode_ptrs_t));
 
+    step_cycles_per_us = hal.f_step_timer / 1000000;
+
+    // Claim a timer with 1 us resolution for the timer driven pulse train, if available.
+    if(hal.timer.claim && step_cycles_per_us &&
+        (ppi_timer = hal.timer.claim((timer_cap_t){ .periodic = On }, 1000))) {
+        timer_cfg_t cfg = {
+            .timeout_callback = ppi_timer_irq
+        };
+        hal.timer.configure(ppi_timer, &cfg);
+    }
+
     hal.user_mcode.check = userMCodeCheck;
     hal.user_mcode.validate = userMCodeValidate;
     hal.user_mcode.execute = userMCodeExecute;
@@ -251,6 +476,9 @@ void ppi_init (void)
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = onRealtimeReport;
 }
 
 #endif
@@ -35,20 +35,67 @@
 
 #if SIENCI_LASER_PWM
 
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 
 #ifdef ARDUINO
 #include "../grbl/hal.h"
+#include "../grbl/gcode.h"
 #include "../grbl/protocol.h"
+#include "../grbl/planner.h"
+#include "../grbl/state_machine.h"
 #include "../grbl/nvs_buffer.h"
 #else
 #include "grbl/hal.h"
+#include "grbl/gcode.h"
 #include "grbl/protocol.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
 #include "grbl/nvs_buffer.h"
 #endif
 
+#ifndef LASER_OPTIONS_SETTING
+#define LASER_OPTIONS_SETTING Setting_UserDefined_8
+#endif
+
+#ifndef LASER_POWER_CURVE_SETTING
+#define LASER_POWER_CURVE_SETTING Setting_UserDefined_7
+#endif
+
+#ifndef LASER_ENABLE_OFF_DELAY_SETTING
+#define LASER_ENABLE_OFF_DELAY_SETTING Setting_UserDefined_6
+#endif
+
+#ifndef LASER_POWER_LUT_SIZE
+#define LASER_POWER_LUT_SIZE 256 // Number of entries in the power curve lookup table, 256 gives direct lookup for 8-bit S values.
+#endif
+
+#ifndef LASER_PWM_FIXED_POINT
+#define LASER_PWM_FIXED_POINT 1 // Change to 0 to map S values to PWM values with the float math of the core.
+#endif
+
+#ifndef LASER_RASTER_ENABLE
+#define LASER_RASTER_ENABLE 0 // Change to 1 to enable raster lines with power values output from the step interrupt.
+#endif
+
+#ifndef LASER_RASTER_PIXELS
+#define LASER_RASTER_PIXELS 1024 // Raster pixel buffer size, must be a power of 2.
+#endif
+
+#ifndef LASER_RASTER_LINES
+#define LASER_RASTER_LINES 16 // Max number of raster lines queued, must be a power of 2.
+#endif
+
+#ifndef MAX_AMASS_LEVEL
+#define MAX_AMASS_LEVEL 3 // As the core, step counts of stepper blocks are scaled by 2^MAX_AMASS_LEVEL for AMASS.
+#endif
+
+#define LASER_POWER_CURVE_LENGTH 64
+#define LASER_POWER_CURVE_POINTS 17
+
 static on_report_options_ptr on_report_options;
+static on_execute_realtime_ptr on_execute_realtime;
 static settings_changed_ptr settings_changed;
 static spindle_state_t laser_state;
 //static spindle_data_t spindle_data = {0};
@@ -56,9 +103,80 @@ static spindle_id_t laser_id = -1;
 
 static bool pwmEnabled = false;
 static spindle_pwm_t laser_pwm;
+static struct {
+    float frequency;
+    uint32_t steps;
+} pwm_output = {0};
+static struct {
+    volatile bool pending;
+    uint32_t delay;
+    uint32_t idle_start;
+} enable_hold = {0};
+static float offset_applied[2] = {0}; // Laser X and Y offset currently added to the tool offsets.
+static float offset_tlo[2] = {0};     // X and Y tool offsets after the laser offset was last applied.
 static float rpm_programmed;
 static void laser_set_speed (uint_fast16_t pwm_value);
 
+static bool laser_selected = false, compensate = false;
+static float rate_factor, speed_ratio = 1.0f;
+static uint_fast16_t pwm_programmed;
+static on_spindle_selected_ptr on_spindle_selected;
+static void (*stepper_pulse_start)(stepper_t *stepper) = NULL;
+
+static struct {
+    bool enabled;
+    float rpm_min;
+    float rpm_max;
+    float factor;
+    uint16_t pwm[LASER_POWER_LUT_SIZE];
+} power_lut = {0};
+
+#if LASER_RASTER_ENABLE
+
+#include "pwm_switch.h"
+
+typedef struct {
+    uint16_t start;
+    uint16_t n_pixels;
+    spindle_ptrs_t spindle; // Copy of the laser spindle handlers the motion of the line is planned with, tags the stepper block.
+} raster_line_t;
+
+static struct {
+    bool enabled;
+    bool active;
+    bool queued;
+    uint_fast16_t pwm;
+    uint_fast16_t pixel;
+    uint_fast16_t pixels_left;
+    int64_t countdown;      // Q16, 64 bit since a pixel may span more than 32767 steps.
+    int64_t pixel_steps;    // Q16
+    uint32_t axis_bit;
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    volatile uint16_t pixel_head;
+    volatile uint16_t pixel_tail;
+    raster_line_t line[LASER_RASTER_LINES];
+    uint16_t pwm_data[LASER_RASTER_PIXELS];
+} raster = {0};
+
+static on_reset_ptr on_reset;
+
+#endif
+
+#if LASER_PWM_FIXED_POINT
+
+#define PWM_RPM_SHIFT 8 // S values are converted to 1/256 units.
+
+static struct {
+    bool enabled;
+    uint_fast8_t shift;
+    uint32_t rpm_min;
+    uint32_t rpm_max;
+    uint32_t gradient;
+} pwm_fixed = {0};
+
+#endif
+
 typedef union {
     uint8_t value;
     struct {
@@ -70,6 +188,16 @@ typedef union {
     };
 } laser_invert_flags_t;
 
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t
+
+        velocity_compensation :1,
+        reserved              :7;
+    };
+} laser_options_t;
+
 typedef struct {
     float rpm_max;
     float rpm_min;
@@ -80,8 +208,24 @@ typedef struct {
     float laser_x_offset;
     float laser_y_offset;
     laser_invert_flags_t invert_flags;  
+    laser_options_t options;
+    char power_curve[LASER_POWER_CURVE_LENGTH + 1];
+    uint16_t enable_off_delay;
 } laser_settings_t;
 
+// Stored size of the settings up to a field, padded as the struct was when that field was last.
+#define LASER_SETTINGS_SIZE(field) ((offsetof(laser_settings_t, field) + sizeof(float) - 1) & ~(sizeof(float) - 1))
+
+// Settings stored by earlier versions, fields have only been appended since v0.01. Leading bytes are kept
+// up to the first field appended later, v0.01 did not set the padding that v0.02 used for the options.
+static const struct {
+    uint32_t size;
+    uint32_t keep;
+} laser_settings_prev[] = {
+    { LASER_SETTINGS_SIZE(enable_off_delay), offsetof(laser_settings_t, enable_off_delay) },  // v0.03 - v0.06
+    { LASER_SETTINGS_SIZE(options), offsetof(laser_settings_t, options) }                     // v0.01 - v0.02
+};
+
 laser_settings_t laser_pwm_settings;
 static nvs_address_t nvs_address;
 
@@ -95,6 +239,9 @@ static const setting_detail_t laser_settings[] = {
      { Setting_Laser_XOffset, Group_Spindle, "Laser X offset",  "mm", Format_Decimal, "-0.000", "-1000", "1000", Setting_IsExtended, &laser_pwm_settings.laser_x_offset, NULL, NULL },
      { Setting_Laser_YOffset, Group_Spindle, "Laser Y offset",  "mm", Format_Decimal, "-0.000", "-1000", "1000", Setting_IsExtended, &laser_pwm_settings.laser_y_offset, NULL, NULL },
      { Setting_LaserInvertMask, Group_Spindle, "Invert laser signals", NULL, Format_Bitfield, "Laser enable,Laser PWM", NULL, NULL, Setting_NonCore, &laser_pwm_settings.invert_flags, NULL, NULL, { .reboot_required = On } },          
+     { LASER_OPTIONS_SETTING, Group_Spindle, "Laser options", NULL, Format_Bitfield, "Velocity compensation", NULL, NULL, Setting_NonCore, &laser_pwm_settings.options, NULL, NULL },
+     { LASER_ENABLE_OFF_DELAY_SETTING, Group_Spindle, "Laser enable off delay", "milliseconds", Format_Int16, "####0", "0", "10000", Setting_NonCore, &laser_pwm_settings.enable_off_delay, NULL, NULL },
+     { LASER_POWER_CURVE_SETTING, Group_Spindle, "Laser power curve", "percent", Format_String, "x(64)", NULL, "64", Setting_NonCore, laser_pwm_settings.power_curve, NULL, NULL },
 };
 
 static const setting_descr_t laser_settings_descr[] = {
@@ -104,19 +251,169 @@ static const setting_descr_t laser_settings_descr[] = {
     { Setting_Laser_PWMOffValue, "Laser PWM off value in percent (duty cycle)." },    
     { Setting_Laser_PWMMinValue, "Laser PWM min value in percent (duty cycle)." },
     { Setting_Laser_PWMMaxValue, "Laser PWM max value in percent (duty cycle)." }, 
-    { Setting_Laser_XOffset, "Laser offset from spindle in X-axis." },
-    { Setting_Laser_YOffset, "Laser offset from spindle in Y-axis." }, 
+    { Setting_Laser_XOffset, "Laser offset from spindle in X-axis, applied as a tool offset when the laser is selected." },
+    { Setting_Laser_YOffset, "Laser offset from spindle in Y-axis, applied as a tool offset when the laser is selected." }, 
     { Setting_LaserInvertMask, "Inverts the laser enable and PWM signals (active high)." },        
+    { LASER_OPTIONS_SETTING, "Velocity compensation scales constant laser power (M3) by the current speed relative to the programmed feed rate." },
+    { LASER_ENABLE_OFF_DELAY_SETTING, "Time the laser enable signal and PWM output are kept on at zero power before switching off, 0 to switch off immediately.\\n"
+                                      "Avoids toggling the enable signal for each zero power pixel or overscan move of a raster line." },
+    { LASER_POWER_CURVE_SETTING, "Comma separated list of 2 to 17 power values in percent, at equally spaced S values from minimum to maximum laser power. Leave blank for linear power." },
 };
 
+static inline uint_fast16_t invert_pwm (spindle_pwm_t *pwm_data, uint_fast16_t pwm_value)
+{
+    return pwm_data->invert_pwm ? pwm_data->period - pwm_value - 1 : pwm_value;
+}
+
+// Scales the duty cycle above min value by the current speed ratio.
+static inline uint_fast16_t laser_compensate_pwm (uint_fast16_t pwm_value)
+{
+    if(speed_ratio < 1.0f && pwm_value != laser_pwm.off_value) {
+        pwm_value = invert_pwm(&laser_pwm, pwm_value);
+        if(pwm_value > laser_pwm.min_value)
+            pwm_value = laser_pwm.min_value + (uint_fast16_t)((float)(pwm_value - laser_pwm.min_value) * speed_ratio);
+        pwm_value = invert_pwm(&laser_pwm, pwm_value);
+    }
+
+    return pwm_value;
+}
+
+// Returns the PWM value to output, the current pixel value when a raster line is active.
+static inline uint_fast16_t laser_output_pwm (void)
+{
+#if LASER_RASTER_ENABLE
+    if(raster.active && laser_state.on)
+        return raster.pwm;
+#endif
+
+    return pwm_programmed;
+}
+
+static void laserUpdatePWM (uint_fast16_t pwm_value)
+{
+    pwm_programmed = pwm_value;
+    pwm_value = laser_output_pwm();
+    laser_set_speed(compensate ? laser_compensate_pwm(pwm_value) : pwm_value);
+}
+
+#if LASER_RASTER_ENABLE
+
+static inline void raster_retire (void)
+{
+    raster_line_t *line = &raster.line[raster.tail];
+
+    raster.queued = false;
+    raster.pixel_tail = line->start + line->n_pixels;
+    raster.tail = (raster.tail + 1) & (LASER_RASTER_LINES - 1);
+}
+
+// Starts output of the queued raster line tagged by the spindle handlers of the block. Lines queued before it
+// are stale since their motion was not executed (e.g. dropped by the planner) and are discarded.
+// Pixels are spaced equally along the dominant axis of the block, in actual steps of that axis.
+static void raster_start (st_block_t *block)
+{
+    uint_fast8_t tail = raster.tail;
+
+#ifdef ENABLE_BACKLASH_COMPENSATION
+    if(block->backlash_motion)
+        return; // Planned with the spindle handlers of the line motion that follows it.
+#endif
+
+    while(block->spindle != &raster.line[tail].spindle) {
+        if((tail = (tail + 1) & (LASER_RASTER_LINES - 1)) == raster.head)
+            return; // Not a raster line motion.
+    }
+
+    while(raster.tail != tail)
+        raster_retire();
+
+    raster_line_t *line = &raster.line[tail];
+
+    if(laser_state.on) {
+
+        uint_fast8_t idx = N_AXIS;
+
+        while(idx && block->steps[--idx] != block->step_event_count);
+
+        raster.axis_bit = 1 << idx;
+        raster.pixel = line->start;
+        raster.pixels_left = line->n_pixels - 1;
+        raster.pixel_steps = (int64_t)(((uint64_t)(block->step_event_count >> MAX_AMASS_LEVEL) << 16) / line->n_pixels);
+        raster.countdown = raster.pixel_steps;
+        raster.pwm = raster.pwm_data[raster.pixel & (LASER_RASTER_PIXELS - 1)];
+        raster.active = raster.queued = true;
+    } else
+        raster_retire();
+}
+
+#endif
+
+// Velocity compensation and raster pixel output, called from the step interrupt.
+// Calculates the speed ratio for each new segment from the segment step rate and the programmed feed rate of the block.
+// Blocks with dynamic power (M4) are only compensated for raster lines since the core already scales power by speed for other blocks.
+static void laserPulseStart (stepper_t *stepper)
+{
+    static segment_t *segment = NULL;
+
+    if(stepper->new_block) {
+
+        st_block_t *block = stepper->exec_block;
+        bool refresh = speed_ratio < 1.0f;
+
+        segment = NULL;
+
+#if LASER_RASTER_ENABLE
+        if(raster.active) {
+            if(raster.queued)
+                raster_retire();
+            raster.active = false;
+            refresh = true;
+        }
+
+        if(raster.tail != raster.head)
+            raster_start(block);
+
+        if((compensate = laser_selected && block->programmed_rate > 0.0f &&
+                          (raster.active ? block->dynamic_rpm || laser_pwm_settings.options.velocity_compensation
+                                         : laser_pwm_settings.options.velocity_compensation && !block->dynamic_rpm)))
+#else
+        if((compensate = laser_selected && laser_pwm_settings.options.velocity_compensation && !block->dynamic_rpm && block->programmed_rate > 0.0f))
+#endif
+            rate_factor = (float)hal.f_step_timer * 60.0f / (block->steps_per_mm * block->programmed_rate);
+        else if(refresh || laser_output_pwm() != pwm_programmed) {
+            speed_ratio = 1.0f;
+            laser_set_speed(laser_output_pwm());
+        }
+    }
+
+    if(compensate && stepper->exec_segment != segment) {
+        segment = stepper->exec_segment;
+        if((speed_ratio = rate_factor / (float)(segment->cycles_per_tick << stepper->amass_level)) > 1.0f)
+            speed_ratio = 1.0f;
+        laser_set_speed(laser_compensate_pwm(laser_output_pwm()));
+    }
+
+#if LASER_RASTER_ENABLE
+    if(raster.active && raster.pixels_left && (stepper->step_outbits.value & raster.axis_bit) && (raster.countdown -= 1 << 16) <= 0) {
+        raster.countdown += raster.pixel_steps;
+        raster.pwm = raster.pwm_data[++raster.pixel & (LASER_RASTER_PIXELS - 1)];
+        if(--raster.pixels_left == 0)
+            raster_retire();
+        if(laser_state.on)
+            laser_set_speed(compensate ? laser_compensate_pwm(raster.pwm) : raster.pwm);
+    }
+#endif
+
+    stepper_pulse_start(stepper);
+}
+
 // Write settings to non volatile storage (NVS).
 static void laser_settings_save (void)
 {
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&laser_pwm_settings, sizeof(laser_pwm_settings), true);
 }
 
-// Restore default settings and write to non volatile storage (NVS).
-static void laser_settings_restore (void)
+static void laser_settings_defaults (void)
 {
     laser_pwm_settings.pwm_freq = 1000;
     laser_pwm_settings.pwm_max_value = 100;
@@ -127,17 +424,39 @@ static void laser_settings_restore (void)
     laser_pwm_settings.invert_flags.value = 0;
     laser_pwm_settings.laser_x_offset = 0;
     laser_pwm_settings.laser_y_offset = 0;
+    laser_pwm_settings.options.value = 0;
+    *laser_pwm_settings.power_curve = '\0';
+    laser_pwm_settings.enable_off_delay = 0;
+}
 
-    
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&laser_pwm_settings, sizeof(laser_pwm_settings), true);
+// Restore default settings and write to non volatile storage (NVS).
+static void laser_settings_restore (void)
+{
+    laser_settings_defaults();
+    laser_settings_save();
 }
 
 // Load our settings from non volatile storage (NVS).
-// If load fails restore to default values.
+// Settings stored by an earlier version are kept and the fields added since set to default values,
+// if load fails restore to default values.
 static void laser_settings_load (void)
 {
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&laser_pwm_settings, nvs_address, sizeof(laser_pwm_settings), true) != NVS_TransferResult_OK)
-        laser_settings_restore();
+    uint_fast8_t idx = 0;
+    laser_settings_t stored;
+
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&laser_pwm_settings, nvs_address, sizeof(laser_pwm_settings), true) == NVS_TransferResult_OK)
+        return;
+
+    do {
+        if(hal.nvs.memcpy_from_nvs((uint8_t *)&stored, nvs_address, laser_settings_prev[idx].size, true) == NVS_TransferResult_OK) {
+            laser_settings_defaults();
+            memcpy(&laser_pwm_settings, &stored, laser_settings_prev[idx].keep);
+            laser_settings_save();
+            return;
+        }
+    } while(++idx < sizeof(laser_settings_prev) / sizeof(laser_settings_prev[0]));
+
+    laser_settings_restore();
 }
 
 static setting_details_t laser_details = {
@@ -175,6 +494,7 @@ static void laserSetState (spindle_state_t state, float rpm)
         laser_on();
     }
 
+    laser_state.on = state.on;
     laser_state.ccw = state.ccw;
 }
 
@@ -191,13 +511,48 @@ static spindle_state_t laserGetState (void)
     return state;
 }
 
-static uint_fast16_t laserGetPWM (float rpm){
+// Maps S value to PWM value, a single table lookup when a power curve is configured.
+// For linear power a fixed point slope is used, the only float operation is the conversion of the S value.
+static uint_fast16_t laser_compute_pwm (float rpm)
+{
+    if(power_lut.enabled) {
+
+        if(rpm <= 0.0f)
+            return laser_pwm.off_value;
+
+        if(rpm >= power_lut.rpm_max)
+            return power_lut.pwm[LASER_POWER_LUT_SIZE - 1];
+
+        if(rpm <= power_lut.rpm_min)
+            return power_lut.pwm[0];
+
+        return power_lut.pwm[(uint_fast16_t)((rpm - power_lut.rpm_min) * power_lut.factor + 0.5f)];
+    }
+
+#if LASER_PWM_FIXED_POINT
+    if(pwm_fixed.enabled) {
+
+        uint_fast16_t pwm_value;
+        uint32_t rpm_fixed = (uint32_t)(rpm * (float)(1 << PWM_RPM_SHIFT));
+
+        if(rpm_fixed >= pwm_fixed.rpm_max)
+            pwm_value = laser_pwm.max_value;
+        else if(rpm_fixed > pwm_fixed.rpm_min)
+            pwm_value = laser_pwm.min_value + (uint_fast16_t)(((uint64_t)(rpm_fixed - pwm_fixed.rpm_min) * pwm_fixed.gradient) >> pwm_fixed.shift);
+        else if(rpm == 0.0f)
+            return laser_pwm.off_value;
+        else
+            pwm_value = laser_pwm.min_value;
+
+        return invert_pwm(&laser_pwm, pwm_value);
+    }
+#endif
+
     return spindle_compute_pwm_value(&laser_pwm, rpm, false);
 }
 
-static inline uint_fast16_t invert_pwm (spindle_pwm_t *pwm_data, uint_fast16_t pwm_value)
-{
-    return pwm_data->invert_pwm ? pwm_data->period - pwm_value - 1 : pwm_value;
+static uint_fast16_t laserGetPWM (float rpm){
+    return laser_compute_pwm(rpm);
 }
 
 static bool laser_precompute_pwm_values (spindle_ptrs_t *spindle, spindle_pwm_t *pwm_data, uint32_t clock_hz)
@@ -217,6 +572,105 @@ static bool laser_precompute_pwm_values (spindle_ptrs_t *spindle, spindle_pwm_t
     return spindle->rpm_max > spindle->rpm_min;
 }
 
+#if LASER_PWM_FIXED_POINT
+
+// Calculates fixed point gradient in PWM counts per 1/256 S value unit, the shift is reduced if needed to fit 32 bits.
+// The gradient is rounded up so that S values that map exactly to a PWM count are not truncated to the count below.
+static void laser_precompute_pwm_fixed (spindle_ptrs_t *laser)
+{
+    if((pwm_fixed.enabled = laser->cap.variable && laser->rpm_max * (float)(1 << PWM_RPM_SHIFT) < 4294967295.0f)) {
+
+        double gradient = (double)(laser_pwm.max_value - laser_pwm.min_value) / ((double)(laser->rpm_max - laser->rpm_min) * (double)(1 << PWM_RPM_SHIFT));
+
+        pwm_fixed.shift = 32;
+        while(pwm_fixed.shift && ldexp(gradient, pwm_fixed.shift) >= 4294967295.0)
+            pwm_fixed.shift--;
+
+        pwm_fixed.gradient = (uint32_t)ceil(ldexp(gradient, pwm_fixed.shift));
+        pwm_fixed.rpm_min = (uint32_t)(laser->rpm_min * (float)(1 << PWM_RPM_SHIFT));
+        pwm_fixed.rpm_max = (uint32_t)(laser->rpm_max * (float)(1 << PWM_RPM_SHIFT));
+    }
+}
+
+#endif
+
+// Parses the power curve setting into fractions of the PWM range, returns number of points or 0 if invalid.
+static uint_fast8_t laser_parse_power_curve (float *points)
+{
+    char *curve = laser_pwm_settings.power_curve;
+    uint_fast8_t cc = 0, n_points = 0;
+    float value;
+
+    while(curve[cc]) {
+
+        if(n_points == LASER_POWER_CURVE_POINTS || !read_float(curve, &cc, &value) || value < 0.0f || value > 100.0f)
+            return 0;
+
+        points[n_points++] = value / 100.0f;
+
+        if(curve[cc] == ',')
+            cc++;
+        else if(curve[cc] != '\0')
+            return 0;
+    }
+
+    return n_points;
+}
+
+// Compiles the power curve into the lookup table by linear interpolation between the curve points.
+static void laser_precompute_power_lut (spindle_ptrs_t *laser)
+{
+    float points[LASER_POWER_CURVE_POINTS], range, x;
+    uint_fast8_t idx, n_points = laser_parse_power_curve(points);
+
+    if((power_lut.enabled = laser->cap.variable && n_points >= 2)) {
+
+        range = (float)(laser_pwm.max_value - laser_pwm.min_value);
+
+        for(uint_fast16_t i = 0; i < LASER_POWER_LUT_SIZE; i++) {
+            x = (float)(i * (n_points - 1)) / (float)(LASER_POWER_LUT_SIZE - 1);
+            if((idx = (uint_fast8_t)x) > n_points - 2)
+                idx = n_points - 2;
+            x = points[idx] + (points[idx + 1] - points[idx]) * (x - (float)idx);
+            power_lut.pwm[i] = (uint16_t)invert_pwm(&laser_pwm, laser_pwm.min_value + (uint_fast16_t)lroundf(x * range));
+        }
+
+        power_lut.rpm_min = laser->rpm_min;
+        power_lut.rpm_max = laser->rpm_max;
+        power_lut.factor = (float)(LASER_POWER_LUT_SIZE - 1) / (laser->rpm_max - laser->rpm_min);
+    }
+}
+
+static inline uint32_t laser_pwm_period (uint32_t clock_hz)
+{
+    return (uint32_t)((float)clock_hz / laser_pwm_settings.pwm_freq);
+}
+
+// Returns the smallest prescaler that gives a period within the timer range, this maximises the duty cycle resolution.
+// The estimate may be off by one due to the integer division of the clock, it is corrected by checking the neighbours.
+static uint32_t laser_pwm_prescaler (uint32_t clock_hz)
+{
+    uint32_t prescaler = 1;
+
+    if(laser_pwm_settings.pwm_freq > 0.0f) {
+
+        prescaler = (uint32_t)ceilf((float)clock_hz / (laser_pwm_settings.pwm_freq * 65534.0f));
+
+        if(prescaler > 65536)
+            prescaler = 65536;
+        else if(prescaler < 1)
+            prescaler = 1;
+
+        while(prescaler > 1 && laser_pwm_period(clock_hz / (prescaler - 1)) <= 65534)
+            prescaler--;
+
+        while(prescaler < 65536 && laser_pwm_period(clock_hz / prescaler) > 65534)
+            prescaler++;
+    }
+
+    return prescaler;
+}
+
 // Start or stop laser
 static void laserSetStateVariable (spindle_state_t state, float rpm)
 {
@@ -227,9 +681,10 @@ static void laserSetStateVariable (spindle_state_t state, float rpm)
             laser_off();
     }
 
+    laser_state.on = state.on;
     laser_state.ccw = state.ccw;
 
-    laser_set_speed(state.on ? spindle_compute_pwm_value(&laser_pwm, rpm, false) : laser_pwm.off_value);
+    laserUpdatePWM(state.on ? laser_compute_pwm(rpm) : laser_pwm.off_value);
     rpm_programmed = rpm;
 }
 
@@ -239,7 +694,7 @@ static bool laserConfig (spindle_ptrs_t *laser)
         return false;
 
     RCC_ClkInitTypeDef clock;
-    uint32_t latency, prescaler = 1;
+    uint32_t latency, clock_hz, prescaler;
 
     HAL_RCC_GetClockConfig(&clock, &latency);
 
@@ -249,21 +704,20 @@ static bool laserConfig (spindle_ptrs_t *laser)
     laser->cap.laser = On;
 
 #if LASER_PWM_TIMER_N == 1
-    if((laser->cap.variable = !settings.spindle.flags.pwm_disable && laser_precompute_pwm_values(laser, &laser_pwm, (HAL_RCC_GetPCLK2Freq() * TIMER_CLOCK_MUL(clock.APB2CLKDivider)) / prescaler))) {
+    clock_hz = HAL_RCC_GetPCLK2Freq() * TIMER_CLOCK_MUL(clock.APB2CLKDivider);
 #else
-    if((laser->cap.variable = !settings.spindle.flags.pwm_disable && laser_precompute_pwm_values(laser, &laser_pwm, (HAL_RCC_GetPCLK1Freq() * TIMER_CLOCK_MUL(clock.APB1CLKDivider)) / prescaler))) {
+    clock_hz = HAL_RCC_GetPCLK1Freq() * TIMER_CLOCK_MUL(clock.APB1CLKDivider);
 #endif
 
-        while(laser_pwm.period > 65534) {
-            prescaler++;
-#if LASER_PWM_TIMER_N == 1
-            laser_precompute_pwm_values(laser, &laser_pwm, (HAL_RCC_GetPCLK2Freq() * TIMER_CLOCK_MUL(clock.APB2CLKDivider)) / prescaler);
-#else
-            laser_precompute_pwm_values(laser, &laser_pwm, (HAL_RCC_GetPCLK1Freq() * TIMER_CLOCK_MUL(clock.APB1CLKDivider)) / prescaler);
-#endif
-        }
+    prescaler = laser_pwm_prescaler(clock_hz);
+
+    if((laser->cap.variable = !settings.spindle.flags.pwm_disable && laser_precompute_pwm_values(laser, &laser_pwm, clock_hz / prescaler))) {
+
+        pwm_output.frequency = (float)clock_hz / (float)(prescaler * laser_pwm.period);
+        pwm_output.steps = laser_pwm.max_value - laser_pwm.min_value;
 
         laser->set_state = laserSetStateVariable;
+        pwm_programmed = laser_pwm.off_value;
 
         LASER_PWM_TIMER->CR1 &= ~TIM_CR1_CEN;
 
@@ -299,8 +753,18 @@ static bool laserConfig (spindle_ptrs_t *laser)
             laser->set_state((spindle_state_t){0}, 0.0f);
 
         laser->set_state = laserSetState;
+        pwm_output.steps = 0;
     }
 
+    laser_precompute_power_lut(laser);
+    enable_hold.delay = laser_pwm_settings.enable_off_delay;
+#if LASER_RASTER_ENABLE
+    raster.enabled = laser->cap.variable;
+#endif
+#if LASER_PWM_FIXED_POINT
+    laser_precompute_pwm_fixed(laser);
+#endif
+
     spindle_update_caps(laser, laser->cap.variable ? &laser_pwm : NULL);
 
     return true;
@@ -320,24 +784,38 @@ static void laserPulseOn (uint_fast16_t pulse_length)
  
 
 
-static void laser_set_speed (uint_fast16_t pwm_value){
-    if (pwm_value == laser_pwm.off_value) {
-        pwmEnabled = false;
-        if(settings.spindle.flags.enable_rpm_controlled)
-            laser_off();
-        if(laser_pwm.always_on) {
-            LASER_PWM_TIMER_CCR = laser_pwm.off_value;
+static void laser_pwm_off (void)
+{
+    enable_hold.pending = false;
+    pwmEnabled = false;
+    if(settings.spindle.flags.enable_rpm_controlled)
+        laser_off();
+    if(laser_pwm.always_on) {
+        LASER_PWM_TIMER_CCR = laser_pwm.off_value;
 #if LASER_PWM_TIMER_N == 1
-            LASER_PWM_TIMER->BDTR |= TIM_BDTR_MOE;
+        LASER_PWM_TIMER->BDTR |= TIM_BDTR_MOE;
 #endif
-            LASER_PWM_TIMER_CCR = pwm_value;
-        } else
+    } else
 #if LASER_PWM_TIMER_N == 1
-            LASER_PWM_TIMER->BDTR &= ~TIM_BDTR_MOE; // Set PWM output low
+        LASER_PWM_TIMER->BDTR &= ~TIM_BDTR_MOE; // Set PWM output low
 #else
-            LASER_PWM_TIMER_CCR = 0;
+        LASER_PWM_TIMER_CCR = 0;
 #endif
+}
+
+static void laser_set_speed (uint_fast16_t pwm_value){
+    if (pwm_value == laser_pwm.off_value) {
+        if(pwmEnabled && laser_state.on && enable_hold.delay) {
+            // Keep the laser enabled at zero power, it is switched off by laser_enable_poll() when idle.
+            LASER_PWM_TIMER_CCR = laser_pwm.always_on ? pwm_value : 0;
+            if(!enable_hold.pending) {
+                enable_hold.idle_start = hal.get_elapsed_ticks();
+                enable_hold.pending = true;
+            }
+        } else
+            laser_pwm_off();
     } else {
+        enable_hold.pending = false;
         if(!pwmEnabled) {
             laser_on();
             pwmEnabled = true;
@@ -349,18 +827,137 @@ static void laser_set_speed (uint_fast16_t pwm_value){
     }    
 }
 
+static void laser_enable_poll (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(enable_hold.pending && hal.get_elapsed_ticks() - enable_hold.idle_start >= enable_hold.delay) {
+        __disable_irq();
+        if(enable_hold.pending)
+            laser_pwm_off();
+        __enable_irq();
+    }
+}
+
+#if LASER_RASTER_ENABLE
+
+// Queues a raster line of n_pixels equally spaced power values for the next feed motion, spindle is the laser spindle handlers.
+// S values are mapped to PWM values here by get_pwm of spindle, including power scaling hooked in by other
+// plugins such as coolant derating. The step interrupt only loads them.
+// Returns the spindle handlers to plan the motion with, a copy that tags it as the raster line, or NULL if the laser
+// is not active or the buffer is full. The caller should then output the line as separate motions.
+spindle_ptrs_t *laser_raster_enqueue (spindle_ptrs_t *spindle, uint_fast16_t n_pixels, laser_raster_rpm_ptr get_rpm)
+{
+    // Lines still queued when no motion is planned or executing are stale.
+    if(raster.tail != raster.head && state_get() == STATE_IDLE && plan_get_current_block() == NULL) {
+        raster.tail = raster.head;
+        raster.pixel_tail = raster.pixel_head;
+    }
+
+    uint_fast8_t head = (raster.head + 1) & (LASER_RASTER_LINES - 1);
+    uint16_t start = raster.pixel_head;
+    raster_line_t *line = &raster.line[raster.head];
+
+    if(!(raster.enabled && laser_selected) || spindle == NULL || spindle->get_pwm == NULL ||
+         n_pixels < 2 || head == raster.tail ||
+          n_pixels > LASER_RASTER_PIXELS - (uint16_t)(start - raster.pixel_tail))
+        return NULL;
+
+    for(uint_fast16_t idx = 0; idx < n_pixels; idx++)
+        raster.pwm_data[(start + idx) & (LASER_RASTER_PIXELS - 1)] = (uint16_t)spindle->get_pwm(get_rpm(idx));
+
+    line->start = start;
+    line->n_pixels = n_pixels;
+    memcpy(&line->spindle, spindle, sizeof(spindle_ptrs_t));
+    raster.pixel_head = start + n_pixels;
+    raster.head = head;
+
+    return &line->spindle;
+}
+
+// Discards queued raster lines, the planner buffer is flushed on reset.
+static void onReset (void)
+{
+    raster.active = raster.queued = false;
+    raster.tail = raster.head;
+    raster.pixel_tail = raster.pixel_head;
+
+    on_reset();
+}
+
+#endif
+
+// Applies the laser offset from the spindle as X and Y tool offsets when the laser is selected,
+// removes it again when another spindle is selected.
+static void laser_set_offset (bool on)
+{
+    uint_fast8_t idx;
+    float offset[2] = {
+        on ? -laser_pwm_settings.laser_x_offset : 0.0f,
+        on ? -laser_pwm_settings.laser_y_offset : 0.0f
+    };
+
+    // Tool offsets changed by G43.x, G49 or a reset after the laser offset was applied no longer include it.
+    for(idx = X_AXIS; idx <= Y_AXIS; idx++) {
+        if(gc_state.tool_length_offset[idx] != offset_tlo[idx])
+            offset_applied[idx] = 0.0f;
+    }
+
+    if(offset[X_AXIS] != offset_applied[X_AXIS] || offset[Y_AXIS] != offset_applied[Y_AXIS]) {
+        for(idx = X_AXIS; idx <= Y_AXIS; idx++) {
+            gc_state.tool_length_offset[idx] += offset[idx] - offset_applied[idx];
+            offset_applied[idx] = offset[idx];
+        }
+        system_flag_wco_change();
+    }
+
+    for(idx = X_AXIS; idx <= Y_AXIS; idx++)
+        offset_tlo[idx] = gc_state.tool_length_offset[idx];
+}
+
 static void on_settings_changed (settings_t *settings, settings_changed_flags_t changed)
 {
+    void (*pulse_start)(stepper_t *stepper) = hal.stepper.pulse_start;
+
     settings_changed(settings, changed);
+
+    // Drivers may (re)assign the step pulse handler when settings are changed, hook it
+    // on first use and again if it was replaced below us.
+    if((LASER_RASTER_ENABLE || laser_pwm_settings.options.velocity_compensation) &&
+        hal.stepper.pulse_start != laserPulseStart &&
+         (stepper_pulse_start == NULL || hal.stepper.pulse_start != pulse_start)) {
+        stepper_pulse_start = hal.stepper.pulse_start;
+        hal.stepper.pulse_start = laserPulseStart;
+    }
     laserConfig(spindle_get_hal(laser_id, SpindleHAL_Configured));
+    laser_set_offset(laser_selected);
+}
+
+static void onSpindleSelected (spindle_ptrs_t *spindle)
+{
+    if(!(laser_selected = spindle->id == laser_id))
+        compensate = false;
+
+    laser_set_offset(laser_selected);
+
+    if(on_spindle_selected)
+        on_spindle_selected(spindle);
 }
 
 static void report_options (bool newopt)
 {
     on_report_options(newopt);
 
-    if(!newopt)
-        hal.stream.write("[PLUGIN:SLB Laser PWM switch v0.01]" ASCII_EOL);
+    if(!newopt) {
+        hal.stream.write("[PLUGIN:SLB Laser PWM switch v0.08]" ASCII_EOL);
+        if(pwm_output.steps) {
+            hal.stream.write("[LASERPWM:");
+            hal.stream.write(ftoa(pwm_output.frequency, 1));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(pwm_output.steps));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
 }
 
 static void warning_msg (uint_fast16_t state)
@@ -389,7 +986,7 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
 
 static void laserUpdateRPM (float rpm)
 {
-    laser_set_speed(laser_state.on ? spindle_compute_pwm_value(&laser_pwm, rpm, false) : laser_pwm.off_value);
+    laserUpdatePWM(laser_state.on ? laser_compute_pwm(rpm) : laser_pwm.off_value);
 }
 
 void pwm_switch_init (void)
@@ -412,7 +1009,7 @@ void pwm_switch_init (void)
         .cap.direction = On,
         .config = laserConfig,
         .get_pwm = laserGetPWM,
-        .update_pwm = laser_set_speed,
+        .update_pwm = laserUpdatePWM,
   #if PPI_ENABLE
         .pulse_on = laserPulseOn,
   #endif
@@ -434,6 +1031,17 @@ void pwm_switch_init (void)
         settings_changed = hal.settings_changed;
         hal.settings_changed = on_settings_changed;         
 
+        on_spindle_selected = grbl.on_spindle_selected;
+        grbl.on_spindle_selected = onSpindleSelected;
+
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = laser_enable_poll;
+
+#if LASER_RASTER_ENABLE
+        on_reset = grbl.on_reset;
+        grbl.on_reset = onReset;
+#endif
+
     } else
         protocol_enqueue_rt_command(warning_msg);
 }
@@ -34,6 +34,9 @@
 #ifndef _PWM_SWITCH_H_
 #define _PWM_SWITCH_H_
 
+typedef float (*laser_raster_rpm_ptr)(uint_fast16_t idx);
+
 void pwm_switch_init (void);
+spindle_ptrs_t *laser_raster_enqueue (spindle_ptrs_t *spindle, uint_fast16_t n_pixels, laser_raster_rpm_ptr get_rpm);
 
 #endif